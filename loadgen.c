@@ -0,0 +1,568 @@
+/*
+ * load generator for the battle server:
+ * Opens many simulated players against the server, has them enter names and
+ * fight (attacking, powermoving and now and then speaking), and reports
+ * connection rate, turn rate and the latency from sending a command to
+ * receiving the status it produces.
+ *
+ * Each thread runs its own epoll loop over its share of the bots. With -b
+ * the bots speak the server's binary protocol instead of text.
+ *
+ * Build: gcc -O2 -pthread -o loadgen loadgen.c
+ * Usage: loadgen [-h host] [-p port] [-n bots] [-t threads] [-d seconds]
+ *                [-c chat%] [-r connects/sec] [-b]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef PORT
+#define PORT 11029
+#endif
+
+// bytes of server output a bot keeps while waiting for the end of a line
+#define INBUF_SIZE 4096
+// maximum number of ready events handled per epoll_wait()
+#define MAX_EVENTS 256
+// latency histogram: 16 sub-buckets for each power of two nanoseconds
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+// the binary protocol; these must match simpleselect.c
+#define BIN_MAGIC 0xB7
+#define BIN_VERSION 1
+#define BIN_JOIN 0x01
+#define BIN_COMMAND 0x02
+#define BIN_CHAT 0x03
+#define BIN_HELLO 0x80
+#define BIN_MATCH 0x84
+#define BIN_STATUS 0x85
+#define BIN_TURN 0x86
+#define BIN_END 0x89
+
+typedef enum { false, true } bool;
+
+/* one simulated player */
+struct bot {
+    int fd;
+    int id;
+    bool connected;
+    bool can_powermove; // "(p)owermoves" was offered this turn
+    bool speaking;      // sent 's' and waits for the "Speak:" prompt
+    bool pending;       // a command is out and its status has not come back
+    uint64_t sent_at;   // when the pending command was sent (ns)
+    bool synced;        // binary: the text prompt has been skipped
+    int inbuf;
+    char buf[INBUF_SIZE];
+};
+
+/* everything one thread measures; merged at the end */
+struct stats {
+    uint64_t connects;
+    uint64_t connect_failures;
+    uint64_t disconnects;
+    uint64_t turns;     // commands whose status came back
+    uint64_t chats;
+    uint64_t matches;
+    uint64_t bytes_read;
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t max_latency;
+};
+
+/* one load-generating thread and its bots */
+struct worker {
+    pthread_t thread;
+    int first;  // id of this worker's first bot
+    int nbots;
+    struct bot *bots;
+    struct stats stats;
+    uint64_t last_connect; // when the last bot finished connecting (ns)
+    unsigned int seed;     // for rand_r(); picks each bot's next command
+};
+
+static void *run_worker(void *arg);
+static int start_connect(struct bot *b);
+static void handle_output(struct worker *w, struct bot *b);
+static void handle_line(struct worker *w, struct bot *b, char *line, int len);
+static int handle_frames(struct worker *w, struct bot *b, char *start, char *end);
+static void handle_frame(struct worker *w, struct bot *b, int type, char *payload, int len);
+static void take_turn(struct worker *w, struct bot *b);
+static void send_str(struct worker *w, struct bot *b, const char *s, int len);
+static void drop_bot(struct worker *w, struct bot *b);
+static uint64_t now_ns(void);
+static void hist_add(struct stats *st, uint64_t ns);
+static uint64_t hist_percentile(struct stats *st, double pct);
+static void print_latency(const char *label, uint64_t ns);
+
+struct sockaddr_in server;
+int nbots = 1000;
+int nthreads = 1;
+int duration = 10;
+int chat_percent = 5;
+int connect_rate = 0; // connections per second, 0 for as fast as possible
+bool binary = false;  // -b: speak the binary protocol
+volatile bool running = true;
+uint64_t start_time;
+
+int main(int argc, char **argv) {
+    int opt, i;
+    const char *host = "127.0.0.1";
+    int port = PORT;
+    struct rlimit rl;
+
+    while ((opt = getopt(argc, argv, "h:p:n:t:d:c:r:b")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'n': nbots = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'c': chat_percent = atoi(optarg); break;
+        case 'r': connect_rate = atoi(optarg); break;
+        case 'b': binary = true; break;
+        default:
+            fprintf(stderr, "Usage: %s [-h host] [-p port] [-n bots] [-t threads] "
+                    "[-d seconds] [-c chat%%] [-r connects/sec] [-b]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nbots < nthreads) {
+        nbots = nthreads;
+    }
+
+    memset(&server, '\0', sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        exit(1);
+    }
+
+    // every bot needs a descriptor
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct worker *workers = calloc(nthreads, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    start_time = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        workers[i].first = i * (nbots / nthreads);
+        workers[i].nbots = nbots / nthreads + (i == nthreads - 1 ? nbots % nthreads : 0);
+        workers[i].seed = i + 1;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    sleep(duration);
+    running = false;
+
+    // merge every worker's numbers
+    struct stats total;
+    uint64_t last_connect = start_time;
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+        struct stats *st = &workers[i].stats;
+        int k;
+        pthread_join(workers[i].thread, NULL);
+        total.connects += st->connects;
+        total.connect_failures += st->connect_failures;
+        total.disconnects += st->disconnects;
+        total.turns += st->turns;
+        total.chats += st->chats;
+        total.matches += st->matches;
+        total.bytes_read += st->bytes_read;
+        for (k = 0; k < HIST_BUCKETS; k++) {
+            total.hist[k] += st->hist[k];
+        }
+        if (st->max_latency > total.max_latency) {
+            total.max_latency = st->max_latency;
+        }
+        if (workers[i].last_connect > last_connect) {
+            last_connect = workers[i].last_connect;
+        }
+    }
+
+    double ramp = (last_connect - start_time) / 1e9;
+    printf("connections: %llu in %.3fs (%.0f/s), %llu failed, %llu dropped by server\n",
+           (unsigned long long)total.connects, ramp,
+           ramp > 0 ? total.connects / ramp : 0.0,
+           (unsigned long long)total.connect_failures,
+           (unsigned long long)total.disconnects);
+    printf("turns: %llu in %ds (%.0f/s), %llu matches, %llu chat lines\n",
+           (unsigned long long)total.turns, duration, (double)total.turns / duration,
+           (unsigned long long)total.matches, (unsigned long long)total.chats);
+    printf("received: %llu bytes (%.1f per turn)\n", (unsigned long long)total.bytes_read,
+           total.turns > 0 ? (double)total.bytes_read / total.turns : 0.0);
+    printf("latency (command -> status):");
+    print_latency(" p50", hist_percentile(&total, 0.50));
+    print_latency(" p99", hist_percentile(&total, 0.99));
+    print_latency(" p999", hist_percentile(&total, 0.999));
+    print_latency(" max", total.max_latency);
+    printf("\n");
+    return 0;
+}
+
+/* the event loop of one worker thread */
+static void *run_worker(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+    int epfd, i, started = 0;
+    int rate = connect_rate / nthreads;
+
+    if ((w->bots = calloc(w->nbots, sizeof(struct bot))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    while (running) {
+        // start more connections, paced by -r if it was given
+        int allowed = w->nbots;
+        if (rate > 0) {
+            allowed = (int)((now_ns() - start_time) / 1000000000.0 * rate) + 1;
+        }
+        while (started < w->nbots && started < allowed) {
+            struct bot *b = &w->bots[started];
+            b->id = w->first + started;
+            started++;
+            if ((b->fd = start_connect(b)) == -1) {
+                w->stats.connect_failures++;
+                continue;
+            }
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = b;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev);
+        }
+
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (i = 0; i < nready; i++) {
+            struct bot *b = events[i].data.ptr;
+            if (b->fd < 0) {
+                continue;
+            }
+            if (b->connected == false && (events[i].events & EPOLLOUT)) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    w->stats.connect_failures++;
+                    close(b->fd);
+                    b->fd = -1;
+                    continue;
+                }
+                char name[32];
+                b->connected = true;
+                w->stats.connects++;
+                w->last_connect = now_ns();
+                if (binary == true) {
+                    // the handshake and the join frame go out together
+                    int len = sprintf(&name[4], "bot%d", b->id);
+                    name[0] = BIN_MAGIC;
+                    name[1] = BIN_VERSION;
+                    name[2] = BIN_JOIN;
+                    name[3] = len;
+                    send_str(w, b, name, 4 + len);
+                } else {
+                    send_str(w, b, name, sprintf(name, "bot%d\n", b->id));
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                handle_output(w, b);
+                if (b->fd < 0) {
+                    continue;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        if (w->bots[i].fd >= 0) {
+            close(w->bots[i].fd);
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+/* start a non-blocking connection to the server. Returns the fd or -1 */
+static int start_connect(struct bot *b) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int yes = 1;
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    // commands are single bytes; don't let Nagle hold them back
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    b->connected = false;
+    b->synced = false;
+    b->inbuf = 0;
+    return fd;
+}
+
+/* read everything the server sent to b and act on each complete line */
+static void handle_output(struct worker *w, struct bot *b) {
+    while (b->fd >= 0) {
+        int n = read(b->fd, &b->buf[b->inbuf], INBUF_SIZE - b->inbuf);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            drop_bot(w, b);
+            return;
+        }
+        b->inbuf += n;
+        w->stats.bytes_read += n;
+
+        char *start = b->buf;
+        char *end = b->buf + b->inbuf;
+        char *nl;
+        if (binary == true) {
+            int used = handle_frames(w, b, start, end);
+            if (b->fd < 0) {
+                return;
+            }
+            b->inbuf -= used;
+            memmove(b->buf, start + used, b->inbuf);
+            continue;
+        }
+        // hand over each complete line, then keep the partial one
+        while ((nl = memchr(start, '\n', end - start)) != NULL) {
+            handle_line(w, b, start, nl - start);
+            if (b->fd < 0) {
+                return;
+            }
+            start = nl + 1;
+        }
+        b->inbuf = end - start;
+        if (b->inbuf == INBUF_SIZE) { // a line longer than we keep: forget it
+            b->inbuf = 0;
+        }
+        memmove(b->buf, start, b->inbuf);
+    }
+}
+
+/* react to one line of server output */
+static void handle_line(struct worker *w, struct bot *b, char *line, int len) {
+#define STARTS(s) (len >= (int)sizeof(s) - 1 && memcmp(line, s, sizeof(s) - 1) == 0)
+#define HAS(s) (memmem(line, len, s, sizeof(s) - 1) != NULL)
+    // the status that answers our command
+    if (b->pending == true && (STARTS("Your hitpoints:") || HAS("You win!")
+                               || HAS("You scurry away"))) {
+        uint64_t ns = now_ns() - b->sent_at;
+        b->pending = false;
+        w->stats.turns++;
+        hist_add(&w->stats, ns);
+    }
+
+    if (STARTS("You engage")) {
+        w->stats.matches++;
+        b->can_powermove = false;
+    }
+    else if (STARTS("(p)owermoves")) {
+        b->can_powermove = true;
+    }
+    else if (STARTS("(s)peak something")) { // our turn
+        take_turn(w, b);
+    }
+    else if (STARTS("Speak:") && b->speaking == true) {
+        b->speaking = false;
+        b->pending = true;
+        b->sent_at = now_ns();
+        w->stats.chats++;
+        send_str(w, b, "good game so far\n", 17);
+    }
+#undef STARTS
+#undef HAS
+}
+
+/* act on every complete frame in [start, end); returns the bytes used up */
+static int handle_frames(struct worker *w, struct bot *b, char *start, char *end) {
+    char *p = start;
+    // everything before the server's BIN_HELLO is the text prompt
+    if (b->synced == false) {
+        char *hello = memchr(p, BIN_HELLO, end - p);
+        if (hello == NULL) {
+            return end - start;
+        }
+        b->synced = true;
+        p = hello;
+    }
+    while (end - p >= 2 && end - p >= 2 + (unsigned char)p[1]) {
+        handle_frame(w, b, (unsigned char)p[0], &p[2], (unsigned char)p[1]);
+        if (b->fd < 0) {
+            break;
+        }
+        p += 2 + (unsigned char)p[1];
+    }
+    return p - start;
+}
+
+/* react to one frame of server output */
+static void handle_frame(struct worker *w, struct bot *b, int type, char *payload, int len) {
+    // the status that answers our command
+    if (b->pending == true && (type == BIN_STATUS || type == BIN_END)) {
+        uint64_t ns = now_ns() - b->sent_at;
+        b->pending = false;
+        w->stats.turns++;
+        hist_add(&w->stats, ns);
+    }
+
+    if (type == BIN_MATCH) {
+        w->stats.matches++;
+    }
+    else if (type == BIN_STATUS && len == 3) {
+        b->can_powermove = payload[1] > 0;
+    }
+    else if (type == BIN_TURN && len == 1 && payload[0] == 1) {
+        take_turn(w, b);
+    }
+}
+
+/* It is b's turn: attack, powermove or, now and then, speak */
+static void take_turn(struct worker *w, struct bot *b) {
+    int roll = rand_r(&w->seed) % 100;
+    char frame[3] = { BIN_COMMAND, 1, 'a' };
+    if (roll < chat_percent && binary == true) {
+        static const char chat[] = { BIN_CHAT, 16, 'g', 'o', 'o', 'd', ' ', 'g', 'a', 'm', 'e',
+                                     ' ', 's', 'o', ' ', 'f', 'a', 'r' };
+        b->pending = true;
+        b->sent_at = now_ns();
+        w->stats.chats++;
+        send_str(w, b, chat, sizeof(chat));
+    } else if (roll < chat_percent) {
+        b->speaking = true;
+        send_str(w, b, "s", 1);
+    } else if (b->can_powermove == true && roll < chat_percent + 20) {
+        b->pending = true;
+        b->sent_at = now_ns();
+        frame[2] = 'p';
+        if (binary == true) {
+            send_str(w, b, frame, 3);
+        } else {
+            send_str(w, b, "p", 1);
+        }
+    } else {
+        b->pending = true;
+        b->sent_at = now_ns();
+        if (binary == true) {
+            send_str(w, b, frame, 3);
+        } else {
+            send_str(w, b, "a", 1);
+        }
+    }
+    b->can_powermove = false;
+}
+
+/* Send a short string to the server. Commands are tiny, so a full socket
+ * buffer means the server has stopped reading; count it as a drop.
+ */
+static void send_str(struct worker *w, struct bot *b, const char *s, int len) {
+    if (write(b->fd, s, len) != len) {
+        drop_bot(w, b);
+    }
+}
+
+/* give up on a bot */
+static void drop_bot(struct worker *w, struct bot *b) {
+    w->stats.disconnects++;
+    close(b->fd);
+    b->fd = -1;
+}
+
+/* monotonic time in nanoseconds */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* record one latency sample; buckets are log-linear, within 1/16 of the value */
+static void hist_add(struct stats *st, uint64_t ns) {
+    int exp, sub;
+    if (ns < HIST_SUB) {
+        exp = 0;
+        sub = (int)ns;
+    } else {
+        exp = 63 - __builtin_clzll(ns) - 3;
+        sub = (int)(ns >> (exp - 1)) - HIST_SUB;
+    }
+    st->hist[exp * HIST_SUB + sub]++;
+    if (ns > st->max_latency) {
+        st->max_latency = ns;
+    }
+}
+
+/* smallest value at or above the given fraction of samples */
+static uint64_t hist_percentile(struct stats *st, double pct) {
+    uint64_t total = 0, seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total += st->hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t want = (uint64_t)(total * pct);
+    if (want >= total) {
+        want = total - 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += st->hist[i];
+        if (seen > want) {
+            int exp = i / HIST_SUB;
+            int sub = i % HIST_SUB;
+            if (exp == 0) {
+                return sub;
+            }
+            // upper edge of the bucket, but never beyond what was seen
+            uint64_t edge = ((uint64_t)(HIST_SUB + sub + 1) << (exp - 1)) - 1;
+            return edge < st->max_latency ? edge : st->max_latency;
+        }
+    }
+    return st->max_latency;
+}
+
+/* print a latency with a readable unit */
+static void print_latency(const char *label, uint64_t ns) {
+    if (ns >= 1000000) {
+        printf("%s %.2fms", label, ns / 1e6);
+    } else {
+        printf("%s %.1fus", label, ns / 1e3);
+    }
+}
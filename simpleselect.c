@@ -4,734 +4,6366 @@
  * communicating over the network.
  *
  * In this case we are willing to wait either for chatter from the client
- * _or_ for a new connection.
+ * _or_ for a new connection. Readiness comes from epoll, so each wakeup only
+ * visits the descriptors that actually have something to say.
+ *
+ * The server runs one event loop (a shard) per thread. Every shard has its
+ * own SO_REUSEPORT listening socket, client table and waiting queue, and a
+ * match always runs inside one shard. Shards talk to each other only through
+ * lock-free inboxes: arena announcements are broadcast that way, and a player
+ * with nobody to fight locally is handed to a shard that has players waiting.
+ *
+ * Every match rolls its dice from its own xoshiro256** generator, seeded
+ * once when the match starts. The seed is logged with -v, and -s makes
+ * every shard's sequence of match seeds deterministic, so any match can be
+ * replayed.
+ *
+ * Input is framed in a small ring buffer per connection. Each search for a
+ * newline resumes where the last one stopped (memchr over at most two runs),
+ * so a line costs O(bytes) however it is split across reads, and several
+ * lines arriving in one read are handled one after another. A line longer
+ * than the ring is cut short instead of closing the connection.
+ *
+ * Bots can skip the prose: a client whose very first byte is BIN_MAGIC
+ * speaks the compact binary protocol described at enum bin_frame instead.
+ *
+ * A named player between matches can watch a match on its shard ("watch
+ * [name]", keeping its place in the queue) or become a dedicated observer
+ * ("observe [name]", leaving it) until "stop". Answering the name prompt
+ * with "observe [name]" makes a dedicated observer that never enters the
+ * arena. Each match event is rendered
+ * once into a buffer all of the match's spectators share, and handed to
+ * them only after the fighters' own output has been flushed. A spectator
+ * that falls too far behind misses events instead of piling them up, and
+ * is shown the score again once it has caught up.
+ *
+ * Each listener is drained with accept4() until EAGAIN (-b sets the listen
+ * backlog). If the process runs out of descriptors, a spare one kept open
+ * for the purpose is given up to accept and immediately close the waiting
+ * connection, so clients are turned away instead of hanging in the queue.
+ *
+ * Time is kept by a hierarchical timer wheel per shard (100 ms ticks). It
+ * drives the turn clock (-T: a player who doesn't move in time attacks
+ * automatically), the deadline for entering a name (-N) and the reaping of
+ * connections that have sent nothing for too long (-I).
+ *
+ * With -u a shard runs on io_uring instead of epoll, if the kernel allows
+ * (otherwise it says so and falls back). Connections then come from a
+ * multishot accept, input from multishot recvs into a ring of provided
+ * buffers, and output goes out as sendmsg requests; everything an iteration
+ * queues reaches the kernel in the one io_uring_enter() that also waits for
+ * the next completions.
+ *
+ * Every finished match adds to the winner's and the loser's totals (wins,
+ * losses, damage dealt and taken), kept per name. Shards hand results to a
+ * writer thread, which appends them in batches to a log (-S path: path.log,
+ * fdatasync()ed once per batch) and updates an index of every player mapped
+ * from path.idx. Shards read the index directly to greet a returning player
+ * with its record, and "top" between matches shows the leaderboard the
+ * writer keeps in memory, so no disk access ever happens on an event loop.
+ * Without -S the same store is kept in memory only.
+ *
+ * Every player also has an Elo rating, kept with its totals. Normally the
+ * waiting queue pairs players oldest first; with -r a waiting player is
+ * paired with the closest rating it can find within a window that widens
+ * the longer it waits. The waiting players of a shard are indexed by rating
+ * in a bucket per rating point, with a bitmap of the buckets in use, so the
+ * closest one is found without walking the queue.
+ *
+ * With -H path the server also listens on a Unix socket at path, and a new
+ * server started with the same -H takes over from it without dropping
+ * anybody. The old one brings every shard to a quiet point, then passes its
+ * listeners and every connection (as SCM_RIGHTS) over that socket, with each
+ * player's session: name, pairing, the state of its match, unread
+ * input and unsent output. The new one carries on where it stood and the
+ * old one exits. If the handover fails part way, the old one carries on.
+ *
+ * Counters and histograms are served in Prometheus text format on a local
+ * admin port (127.0.0.1:ADMIN_PORT, or -m port; -m 0 turns it off) by a
+ * separate thread, so scraping never touches the event loops. GET
+ * /leaderboard there lists the top players.
+ *
+ * Input is rationed per connection by three token buckets: bytes (-k),
+ * lines or frames (-l) and chat lines (-c), each refilled every tick and
+ * holding RATE_BURST_SECS worth. A connection may run into debt by what one
+ * read delivered; then its reads are paused in the event loop until the
+ * debt is paid off, so the kernel holds the rest and the sender is slowed
+ * by TCP. One that keeps running over its byte rate (THROTTLE_STRIKES
+ * pauses without a THROTTLE_FORGIVE second break) is taken for a flood and
+ * disconnected; too many lines or chat lines only make it wait.
+ *
+ * Each shard also keeps a flight recorder: a ring of the last TRACE_EVENTS
+ * timestamped events (loop iterations, input handling, turns, matchmaking,
+ * flushes, drops and blocked writes), written by the shard alone with no
+ * locks. SIGUSR1 dumps every ring to trace.<pid>.<n>.json in the working
+ * directory, and GET /trace on the admin port returns the same; both open
+ * in Perfetto or chrome://tracing.
+ *
+ * The rules of a match live in struct battle, which knows nothing about
+ * connections. With -B n the program serves nobody: it plays n battles
+ * between two bots spread over the -t threads, as fast as it can, and
+ * prints how they went and how long a turn took.
+ *
+ * Build: gcc -O2 -pthread -o simpleselect simpleselect.c
+ * Usage: simpleselect [-t threads] [-s seed] [-m admin port] [-v]
+ *                     [-T turn secs] [-N name secs] [-I idle secs] [-b backlog]
+ *                     [-u] [-S stats path] [-H restart socket] [-r]
+ *                     [-o output KB] [-O output budget MB]
+ *                     [-k input KB/sec] [-l lines/sec] [-c chat lines/sec]
+ *        simpleselect -B matches [-t threads] [-s seed]
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <time.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <libgen.h>
+#include <linux/io_uring.h>
 
 #ifndef PORT
 #define PORT 11029
 #endif
+#ifndef ADMIN_PORT
+#define ADMIN_PORT 12029
+#endif
+
+// maximum number of ready events handled per epoll_wait()
+#define MAX_EVENTS 256
+// maximum number of connections accepted per wakeup; the listener is
+// level-triggered, so the rest are picked up on the next pass
+#define ACCEPT_BATCH 128
+
+// io_uring backend (-u): queue sizes, and the buffers multishot receives
+// pick from. RECV_BUFS must be a power of two
+#define RING_ENTRIES 1024
+#define RING_CQ_ENTRIES 8192
+#define RECV_BUFS 512
+#define RECV_BUF_SIZE 2048
+
+// output segments a spectator may have queued before match events skip it
+#define SPECTATOR_BACKLOG 64
+// unsent output a client may have before it is disconnected (-o, in KB);
+// past a quarter of that it is skipped by chat, announcements and match
+// events it only watches. Past OUTPUT_BUDGET (-O, in MB) for the whole
+// server, a quarter is already too much, and stalled clients are skipped
+#define OUTPUT_LIMIT (1 << 20)
+#define OUTPUT_BUDGET (256 << 20)
+
+// input a connection may send per second: bytes (-k, in KB), lines or
+// frames (-l) and chat lines (-c); 0 for no limit. Each bucket holds
+// RATE_BURST_SECS worth. A connection paused THROTTLE_STRIKES times for
+// its byte rate, with no more than THROTTLE_FORGIVE seconds between
+// pauses, is disconnected
+#define INPUT_RATE (8 << 10)
+#define COMMAND_RATE 200
+#define CHAT_RATE 5
+#define RATE_BURST_SECS 2
+#define THROTTLE_STRIKES 10
+#define THROTTLE_FORGIVE 10
+
+// size of the private buffers a client's own output is collected in
+#define OUTBUF_SIZE 4096
+// maximum number of chunks handed to a single writev()
+#define MAX_IOV 64
+
+// space for a player's name, and for one short enough to keep in struct client
+#define NAME_SIZE 200
+#define NAME_SHORT 32
+// room to reserve for a text message with one name and a few numbers in it
+#define MSG_SIZE (NAME_SIZE + 64)
+// size of the input ring buffer, must be a power of two. Longer lines are cut
+#define BUF_SIZE 512
+// number of objects carved out of each slab a pool allocates
+#define SLAB_OBJECTS 64
+
+// timer wheel: each level has 1 << WHEEL_BITS slots, and a slot of level n
+// spans (1 << WHEEL_BITS)^n ticks, so three levels reach about 19 days
+#define TICK_NS 100000000ULL // 100 ms
+#define TICKS_PER_SEC 10
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+
+// player stats store: slots in the index (a power of two; it takes new
+// players until it is 3/4 full), players on the leaderboard, how often the
+// writer thread takes a batch, and how often it makes the index durable
+#define STATS_SLOTS (1 << 16)
+#define STATS_HEADER_SIZE 4096
+#define STATS_MAGIC 0x32545342 // "BST2"
+#define TOP_N 10
+#define STATS_BATCH_MS 50
+#define STATS_CHECKPOINT_SECS 10
+// the log is rewritten with one record per player once it is this big and
+// mostly superseded records
+#define STATS_COMPACT_BYTES (64 << 20)
+
+// ratings: where a new player starts, the most one match can move a
+// rating, and (with -r) how far apart two players may be when one of them
+// starts waiting and how much further for every second it has waited.
+// Ratings are indexed in RATING_BUCKETS buckets of one point each (ratings
+// outside them share the end buckets); RATING_BUCKETS must be a multiple of 64
+#define RATING_START 1500
+#define RATING_K 32
+#define RATING_WINDOW 50
+#define RATING_WIDEN 25
+#define RATING_BUCKETS 4096
+
+// hot restart (-H): sessions per message on the restart socket, the
+// largest message, and the most descriptors one message can carry (SCM_MAX_FD)
+#define RESTART_BATCH 64
+#define RESTART_MSG_SIZE 65536
+#define RESTART_MAX_FDS 253
+#define RESTART_MAGIC 0x31525442 // "BTR1"
+
+// flight recorder: events kept in each shard's trace ring (a power of two)
+#define TRACE_EVENTS (1 << 16)
+
+// default timeouts in seconds; 0 turns one off
+#define TURN_TIMEOUT 30
+#define NAME_TIMEOUT 60
+#define IDLE_TIMEOUT 600
 
 typedef enum { false, true } bool;
 
+// Messages are rendered straight into the output queue from constant pieces
+// (see out_begin()). PUT copies a string literal whose length the compiler
+// already knows and steps past it; QUEUE_LITERAL queues one as it is.
+#define PUT(at, lit) (memcpy((at), (lit), sizeof(lit) - 1), (at) + sizeof(lit) - 1)
+#define QUEUE_LITERAL(p, lit) queue_output((p), (lit), sizeof(lit) - 1)
+
+/* Binary protocol. A client opts in by sending BIN_MAGIC and BIN_VERSION
+ * as its first two bytes; the server answers with a BIN_HELLO frame. The
+ * text prompt has already been sent by then, so the client skips whatever
+ * comes before the first BIN_HELLO. After that both directions carry frames
+ * of one type byte, one payload length byte and the payload. Numbers are
+ * single bytes; hitpoints are signed.
+ */
+#define BIN_MAGIC 0xB7
+#define BIN_VERSION 1
+enum bin_frame {
+    // client to server
+    BIN_JOIN = 0x01,    // name
+    BIN_COMMAND = 0x02, // 'a' or 'p', on the player's turn
+    BIN_CHAT = 0x03,    // message, on the player's turn
+    BIN_WATCH = 0x04,   // between matches (or instead of BIN_JOIN): 0 to watch, 1 to observe;
+                        // then a fighter's name (empty: any)
+    BIN_STOP = 0x05,    // (empty) stop watching
+    // server to client
+    BIN_HELLO = 0x80,   // version
+    BIN_ENTER = 0x81,   // name of a player who entered the arena
+    BIN_LEAVE = 0x82,   // name of a player who left
+    BIN_WAITING = 0x83, // (empty) waiting for an opponent
+    BIN_MATCH = 0x84,   // opponent's name; a match starts
+    BIN_STATUS = 0x85,  // hitpoints, powermoves, opponent's hitpoints
+    BIN_TURN = 0x86,    // 1 if it is your move, 0 if the opponent's
+    BIN_DAMAGE = 0x87,  // flags (BIN_DAMAGE_*), damage (0 is a miss)
+    BIN_CHAT_FROM = 0x88, // 1 if you said it, 0 if the opponent did; message
+    BIN_END = 0x89,     // BIN_END_* result of the match
+    // server to spectator; fighter 0 is the one who moved first
+    BIN_SPECTATE = 0x8A,   // fighter index, fighter's name; empty if not watching any more
+    BIN_SEE_DAMAGE = 0x8B, // attacker index, flags (BIN_DAMAGE_POWERMOVE), damage
+    BIN_SEE_STATUS = 0x8C, // hitpoints and powermoves of fighter 0, then of fighter 1
+    BIN_SEE_CHAT = 0x8D,   // speaker index, message
+    BIN_SEE_END = 0x8E     // winner index, 1 if the loser dropped
+};
+#define BIN_DAMAGE_DEALT 0x01     // you hit the opponent (otherwise you were hit)
+#define BIN_DAMAGE_POWERMOVE 0x02
+#define BIN_END_LOST 0
+#define BIN_END_WON 1
+#define BIN_END_DROPPED 2          // you win because the opponent disconnected
+// largest payload a frame can carry
+#define BIN_PAYLOAD_MAX 255
+
+/* Free list of fixed-size objects. Objects are carved out of slabs and never
+ * handed back to malloc, so a pool grows to the peak number of live objects
+ * and then stays flat however fast connections come and go.
+ */
+struct pool {
+    void *free;   // first free object; each free object starts with the next
+    size_t size;  // bytes per object
+};
+
+/* Reference-counted block of output bytes. A broadcast builds one of these
+ * and every recipient's queue points at it; the last one to send it frees it.
+ */
+struct outbuf {
+    atomic_int refs; // shared across shards, so updated atomically
+    int len; // bytes used
+    int cap; // bytes allocated in data
+    char data[];
+};
+
+/* one entry of a client's output queue */
+struct outseg {
+    struct outseg *next;
+    struct outbuf *buf;
+    int start; // first byte of buf not yet written to this client
+};
+
+/* why a connection was closed, for the disconnect counters */
+enum drop_reason {
+    DROP_PEER_CLOSED,    // the player closed the connection
+    DROP_READ_ERROR,
+    DROP_WRITE_ERROR,
+    DROP_INTERNAL,       // out of memory or the event loop refused the fd
+    DROP_TIMEOUT,        // no name in time, or idle for too long
+    DROP_SLOW,           // the player left too much output unread
+    DROP_FLOOD,          // the player kept sending more bytes than its rate allows
+    NDROP_REASONS
+};
+
+// histogram bucket bounds in nanoseconds
+#define NWAIT_BUCKETS 8
+#define NTURN_BUCKETS 9
+static const uint64_t wait_bounds[NWAIT_BUCKETS] = {
+    1000000, 10000000, 100000000, 1000000000ULL, 5000000000ULL,
+    10000000000ULL, 60000000000ULL, 300000000000ULL
+};
+static const uint64_t turn_bounds[NTURN_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 1000000, 10000000
+};
+
+/* Counters a shard keeps for the admin socket. Only the shard's own thread
+ * writes them (see STAT_ADD); the admin thread reads them as they change.
+ */
+struct metrics {
+    atomic_long clients;             // connected players
+    atomic_long matches;             // matches in progress
+    atomic_ulong turns;              // attacks and powermoves handled
+    atomic_ulong turn_timeouts;      // turns played automatically
+    atomic_ulong accepts;            // connections accepted
+    atomic_ulong accepts_shed;       // connections closed at once for lack of descriptors
+    atomic_long spectators;          // players watching a match
+    atomic_ulong spectator_skips;    // match events a slow spectator missed
+    atomic_long output_bytes;        // output queued and not yet sent
+    atomic_ulong output_skips;       // chat lines and announcements a backlogged player missed
+    atomic_ulong throttles;          // times a player's reads were paused for its rate limits
+    atomic_ulong bytes_read;
+    atomic_ulong bytes_written;
+    atomic_ulong read_calls;
+    atomic_ulong write_calls;
+    atomic_ulong ring_enters;
+    atomic_ulong disconnects[NDROP_REASONS];
+    atomic_ulong wait_hist[NWAIT_BUCKETS + 1]; // last bucket is +Inf
+    atomic_ulong wait_count;
+    atomic_ulong wait_sum_ns;
+    atomic_ulong turn_hist[NTURN_BUCKETS + 1];
+    atomic_ulong turn_count;
+    atomic_ulong turn_sum_ns;
+};
+
+// bump one of this shard's counters. There is a single writer, so a plain
+// load and store is enough and avoids a locked instruction
+#define STAT_ADD(field, n) \
+    atomic_store_explicit(&self->stats.field, \
+        atomic_load_explicit(&self->stats.field, memory_order_relaxed) + (n), \
+        memory_order_relaxed)
+// one of those counters summed over every shard
+#define SUM(field) sum_shards(offsetof(struct shard, field))
+
+/* what a trace event records; see write_trace() for their names */
+enum trace_kind {
+    TRACE_LOOP,        // one event loop iteration; arg: descriptors or completions ready
+    TRACE_INPUT,       // handling one line or frame; arg: player id
+    TRACE_TURN,        // an attack or powermove; arg: player id
+    TRACE_MATCHMAKING, // looking for an opponent; arg: player id
+    TRACE_FLUSH,       // sending the iteration's output; arg: clients flushed
+    // instants from here on
+    TRACE_DROP,        // (instant) a player removed; arg: player id
+    TRACE_BLOCKED,     // (instant) a write found the socket buffer full; arg: player id
+    NTRACE_KINDS
+};
+
+/* One slot of a shard's trace ring. A span runs from start for duration
+ * nanoseconds; an instant has a duration of 0.
+ */
+struct trace_event {
+    uint64_t start;    // now_ns()
+    uint32_t duration; // ns, capped at UINT32_MAX
+    uint16_t kind;     // enum trace_kind
+    uint16_t unused;
+    uint64_t arg;
+    uint64_t unused2;  // pads the slot to 32 bytes
+};
+
+/* xoshiro256** generator state */
+struct rng {
+    uint64_t s[4];
+};
+
+/* what a timer does when it fires */
+enum timer_kind {
+    TIMER_IDLE, // no name yet, or nothing received for too long: disconnect
+    TIMER_TURN, // the active player's turn clock ran out: attack for them
+    TIMER_MATCH, // (-r) a waiting player's rating window widened: look again
+    TIMER_THROTTLE // reads were paused for the player's rate limits: resume if it is out of debt
+};
+
+/* what a connection's token buckets ration */
+enum rate_kind {
+    RATE_BYTES,
+    RATE_COMMANDS, // lines and frames
+    RATE_CHAT,     // chat lines
+    NRATES
+};
+
+/* A timer in a shard's wheel. Timers sit in doubly-linked slot lists, so
+ * arming and cancelling are O(1); an unarmed timer has pprev == NULL.
+ */
+struct timer {
+    struct timer *next;
+    struct timer **pprev;   // the pointer that points at this timer
+    uint64_t expires;       // tick it fires at
+    struct client *owner;
+    enum timer_kind kind;
+};
+
+/* The rules of one match, apart from any connection: a move goes in and
+ * what it did comes out as a struct battle_event, for the caller to tell
+ * whoever needs to know. Fighter 0 moves first. A battle is a plain value
+ * with its own generator, so the shards and the simulator (-B) play it the
+ * same way and neither needs to allocate anything.
+ */
+struct battle {
+    struct rng rng;     // every roll of the match comes from here
+    int hitpoints[2];
+    int powermoves[2];
+    int start_hp[2];    // hitpoints at the start, for the damage totals
+    int turn;           // the fighter to move
+    int winner;         // -1 until a fighter is down
+};
+
+/* what one move did */
+struct battle_event {
+    int attacker;    // the fighter who moved
+    bool powermove;
+    int damage;      // 0 if a powermove missed
+    bool over;       // true if the other fighter is down false otherwise
+};
+
+/* state shared by the two players of one match */
+struct match {
+    uint64_t seed;  // logged at the start so the match can be replayed
+    struct battle battle;
+    struct client *fighters[2];  // fighters[0] moves first
+    struct client *viewers;      // spectators, linked through view_next/view_prev
+    struct outbuf *seen;         // events since the last fan-out, rendered as text
+    struct outbuf *seen_bin;     // the same events as frames
+    struct match *seen_next;     // link in the shard's list of matches with events to fan out
+    bool if_seen;    // true if the match is in that list false otherwise
+    bool if_over;    // true if the match has ended but its spectators haven't been told false otherwise
+};
+
+/* A connection and its player. The fields every event touches come first
+ * and share the first two cache lines; the rest is only looked at when the
+ * player's state changes. An idle connection has no input buffer (see
+ * inbuf_attach()) and a short name lives in the struct itself, so most of
+ * one is the few hundred bytes below.
+ */
 struct client {
     int fd;
-    struct in_addr ipaddr;
+    char command;
+    bool if_name : 1;    // true if name is completely entered false otherwise
+    bool in_match : 1;   // true if the player is in match false otherwise
+    bool if_active : 1;  // true if the player is an active player false otherwise
+    bool if_waiting : 1; // true if the player is in the waiting queue false otherwise
+    bool if_leaving : 1; // true if the player is about to move to another shard false otherwise
+    bool if_dirty : 1;   // true if the player is in the dirty list false otherwise
+    bool if_blocked : 1; // true if the socket buffer is full until EPOLLOUT (or a send is in flight on the ring) false otherwise
+    bool if_receiving : 1; // true if a multishot recv is armed on the shard's ring false otherwise
+    bool if_observing : 1; // true if the player only watches and stays out of the waiting queue false otherwise
+    bool if_lagging : 1;   // true if match events were skipped for the player false otherwise
+    bool if_discarding : 1; // true if the rest of an overlong line is being dropped false otherwise
+    bool if_binary : 1;  // true if the player speaks the binary protocol false otherwise
+    bool if_throttled : 1; // true if reads are paused until the player's input debt is paid false otherwise
+    unsigned int inhead;         // first unhandled byte (free-running, mask to index)
+    unsigned int intail;         // one past the last byte read (free-running)
+    unsigned int inscan;         // bytes after inhead already searched for '\n'
+    char *buf;                   // input ring buffer of BUF_SIZE bytes, NULL while no input is pending
+    struct outseg *outhead;    // output not yet accepted by the socket
+    struct outseg *outtail;
+    int nsegs;                   // segments in the output queue
+    long outbytes;               // bytes in the output queue
     struct client *next;
+    struct client *prev;
     struct client *opponent;
-    struct client *last_opponent;
-    char *name;
-    char *buf;
-    int inbuf;
-    bool if_name;    // true if name is completely entered false otherwise
-    bool in_match;   // true if the player is in match false otherwise
-    bool if_active;  // true if the player is an active player false otherwise
-    int hitpoints;
-    int powermoves;
+    struct match *match;         // the current match, NULL if not in one
+    struct client *dirty_next; // links in the list of clients with output to flush
+    struct client *dirty_prev;
+    uint64_t last_input;         // tick of the last read that returned data
+    struct shard *move_to;       // where p goes once its ring requests finish, NULL if not moving
+    
+    struct in_addr ipaddr;
+    int rating;
+    unsigned long id;            // unique per connection, never reused
+    unsigned long last_opponent; // id of the previous opponent, 0 if none
+    uint64_t wait_since;         // when the player started waiting (ns), 0 if not
+    struct timer idle_timer;     // name deadline, then idle reaping
+    struct timer turn_timer;     // armed while it is the player's turn
+    struct timer match_timer;    // armed while the player waits (-r) or to retry a match
+    struct timer throttle_timer; // armed while reads are paused
+    int32_t tokens[NRATES];      // what each bucket holds, in units of 1/TICKS_PER_SEC
+    uint32_t refilled;           // tick the buckets were last topped up
+    uint32_t throttled_until;    // tick the last pause ended
+    unsigned char strikes;       // pauses for the byte rate without a THROTTLE_FORGIVE break
+    struct client *wait_next; // links in the queue of players waiting for a match
+    struct client *wait_prev;
+    struct client *rate_next;  // (-r) links in the waiting players' rating bucket
+    struct client *rate_prev;
+    struct match *watching;      // the match p spectates, NULL if none
+    struct client *view_next;    // links in that match's list of spectators
+    struct client *view_prev;
+    char *name;                  // short_name, or a NAME_SIZE block for a longer name
+    int namelen;
+    char short_name[NAME_SHORT];
+};
+
+/* kinds of message one shard can post to another */
+enum shard_msg_type {
+    MSG_CLIENT,    // adopt a waiting player handed off by another shard
+    MSG_BROADCAST, // send an arena announcement to every local player
+    MSG_REBALANCE, // this shard has players waiting; send one down if possible
+    MSG_FREEZE,    // stop at a quiet point and wait for a hot restart's handover
+    MSG_RESTORE    // take over a session handed over by the previous process
+};
+
+/* a message in a shard's inbox */
+struct shard_msg {
+    struct shard_msg *next;
+    enum shard_msg_type type;
+    struct client *p;    // MSG_CLIENT
+    struct outbuf *b;    // MSG_BROADCAST, text rendering
+    struct outbuf *bin;  // MSG_BROADCAST, binary rendering
+};
+
+/* State of one event loop that other threads may look at. Everything else
+ * a shard owns lives in the thread-local variables below.
+ */
+struct shard {
+    int index;
+    pthread_t thread;
+    int listenfd;                        // this shard's SO_REUSEPORT listener
+    int wakefd;                          // eventfd that wakes the shard for inbox mail
+    _Atomic(struct shard_msg *) inbox;   // lock-free stack of incoming messages
+    atomic_int nwaiting;                 // players in this shard's waiting queue
+    struct metrics stats;                // read by the admin thread
+    struct client *frozen;               // the shard's clients while it waits for a handover
+    struct trace_event *trace;           // the flight recorder: TRACE_EVENTS slots
+    atomic_ulong trace_head;             // events ever recorded; the next goes in trace_head % TRACE_EVENTS
+} __attribute__((aligned(64)));
+
+/* A shard's io_uring: the submission and completion queues shared with the
+ * kernel, and the ring of provided buffers that multishot receives fill.
+ */
+struct ring {
+    int fd; // -1 if the shard runs on epoll
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sq_entries;
+    unsigned int tail;           // our submission tail, published at io_uring_enter()
+    void *rings;                 // the mapping both queues live in
+    size_t rings_size;
+    struct io_uring_buf_ring *br;
+    char *bufs;                  // RECV_BUFS buffers of RECV_BUF_SIZE bytes
+    unsigned short br_tail;
+};
+
+/* what a completion on the ring is for, kept in the top byte of user_data */
+enum ring_op {
+    RING_ACCEPT = 1, // multishot accept on the listener
+    RING_WAKE,       // multishot poll on the inbox eventfd
+    RING_RECV,       // multishot recv; the rest is the fd and the low half of the client's id
+    RING_SEND,       // sendmsg; the rest points at its struct sendreq
+    RING_CANCEL      // cancellation of a moving client's requests
+};
+#define RING_DATA(op, rest) ((uint64_t)(op) << 56 | (uint64_t)(rest))
+
+/* A sendmsg in flight on the ring. It holds a reference to every buffer it
+ * points into, so they outlive the client if it is dropped meanwhile.
+ */
+struct sendreq {
+    struct msghdr msg;
+    int fd;
+    unsigned long id;
+    int nbufs;
+    struct iovec iov[MAX_IOV];
+    struct outbuf *bufs[MAX_IOV];
+};
+
+/* One player's totals as they stood after a match. The log is a sequence of
+ * these, and the last one for a name is the one that counts, so replaying
+ * any part of the log twice does no harm.
+ */
+struct stats_record {
+    uint32_t check;   // checksum of the rest, so a torn write is noticed
+    uint32_t namelen;
+    uint32_t wins;
+    uint32_t losses;
+    uint64_t dealt;   // damage dealt over all matches
+    uint64_t taken;   // damage taken
+    int32_t rating;
+    uint32_t unused;
+    char name[NAME_SIZE];
+};
+
+/* A slot of the index. Only the writer thread changes slots; shards read
+ * them without locking and try again if seq was odd or moved meanwhile.
+ */
+struct stats_entry {
+    atomic_uint seq;
+    uint32_t used;    // 0 for a free slot, which ends a probe
+    uint64_t hash;
+    struct stats_record rec;
+};
+
+/* first page of the index file */
+struct stats_header {
+    uint32_t magic;
+    uint32_t slots;
+    uint32_t record_size;
+    uint32_t unused;
+    uint64_t log_ino;  // the log the index was built from
+    uint64_t applied;  // bytes of the log the slots already reflect
+};
+
+/* a finished match's result for one player, on its way to the writer thread */
+struct stats_update {
+    struct stats_update *next;
+    bool won;
+    int dealt;
+    int taken;
+    int rating;       // the player's rating after the match
+    int namelen;
+    char name[NAME_SIZE];
+};
+
+/* Messages on the restart socket. Each starts with its type; the new
+ * process answers RESTART_DONE with RESTART_ACK.
+ */
+enum restart_msg {
+    RESTART_HELLO = 1, // struct restart_hello; the listeners ride along
+    RESTART_CLIENTS,   // count, then that many struct session_image; their sockets ride along
+    RESTART_MATCHES,   // count, then that many struct match_image
+    RESTART_OUTPUT,    // session index, then some of its unsent output
+    RESTART_DONE,
+    RESTART_ACK
+};
+
+/* first message of a handover */
+struct restart_hello {
+    uint32_t type;
+    uint32_t magic;
+    uint32_t image_size;  // sizeof(struct session_image), so a different layout is refused
+    uint32_t nlisteners;  // one per old shard, then the admin listener if has_admin
+    uint32_t has_admin;
+    uint32_t unused;
+    uint64_t next_id;
+};
+
+/* A player's session on its way to the new process. Clients are referred
+ * to by their position in the handover, -1 for none; a match by the
+ * position of the fighter who moves first.
+ */
+struct session_image {
+    uint64_t id;
+    uint64_t last_opponent;
+    uint64_t wait_since;
+    uint32_t ipaddr;
+    int32_t shard;       // where it was; it goes to shard % nshards
+    int32_t opponent;
+    int32_t match;       // the match it fights in
+    int32_t watching;    // the match it watches
+    int32_t rating;
+    int32_t namelen;
+    int32_t inlen;       // unhandled input, moved to the start of buf
+    int32_t inscan;
+    uint32_t outlen;     // unsent output, which follows in RESTART_OUTPUT messages
     char command;
+    uint8_t if_name;
+    uint8_t in_match;
+    uint8_t if_active;
+    uint8_t if_binary;
+    uint8_t if_discarding;
+    uint8_t if_observing;
+    uint8_t if_lagging;
+    char name[NAME_SIZE];
+    char buf[BUF_SIZE];
+};
+
+/* a match on its way to the new process */
+struct match_image {
+    int32_t fighters[2];
+    int32_t hitpoints[2];
+    int32_t powermoves[2];
+    int32_t start_hp[2];
+    int32_t turn;
+    int32_t unused;
+    uint64_t seed;
+    uint64_t rng[4];
+};
+
+/* a session being handed over, and the shard it was on */
+struct session_ref {
+    struct client *p;
+    int shard;
+};
+
+/* One simulator thread's share of the battles (-B) and what came of them.
+ * The thread counts in locals and fills these in once it is done.
+ */
+struct sim_job {
+    pthread_t thread;
+    uint64_t seed_state; // where its battles' seeds come from
+    long matches;
+    long first_wins;     // battles won by the fighter who moved first
+    long turns;
+    long powermoves;     // powermoves played
+    long powermove_hits;
+    long damage;         // damage done by every move
+};
+
+/* one line of the leaderboard */
+struct leader {
+    uint32_t wins;
+    uint32_t losses;
+    int namelen;
+    char name[NAME_SIZE];
+};
+
+/* The best TOP_N players by wins. The writer thread republishes it after
+ * every batch; readers copy it out and retry if seq was odd or moved.
+ */
+struct leaderboard {
+    atomic_uint seq;
+    int n;
+    struct leader top[TOP_N];
 };
 
 int end_match(struct client **head, struct client *p);
-int speak(struct client *p, int nbytes);
-char get_command(struct client **head, struct client *p, int nbytes);
+int speak(struct client *p);
+static int say(struct client *p, const char *message, int len);
+char get_command(struct client **head, struct client *p);
+static int take_turn(struct client **head, struct client *p);
 int find_valid_command(struct client *p);
 int handle_command(struct client **head, struct client *p);
 int print_inactive_player(struct client *p);
 int print_active_player(struct client *p);
 int print_status(struct client *p);
-int start_match(struct client *head, struct client *player, struct client *opponent);
+static int print_waiting(struct client *p);
+static int print_engage(struct client *p);
+static int queue_chat(struct client *p, int mine, const char *message, int len);
+static int print_damage(struct client *p, bool powermove, int damage);
+static int lobby_command(struct client **head, struct client *p);
+static int lobby_line(struct client *head, struct client *p, const char *line, int len);
+static int spectate(struct client *head, struct client *p, const char *name, int len, bool observing);
+static int stop_spectating(struct client *head, struct client *p);
+static void stop_watching(struct client *p);
+static struct match *find_match(struct client *head, const char *name, int len);
+static int print_spectate(struct client *p);
+static int print_score(struct client *p);
+static char *put_score(char *at, struct match *m);
+static void score_frame(struct match *m, char *frame);
+static int fighter(struct client *p);
+static char *see_begin(struct match *m, struct outbuf **b, int max);
+static void see_end(struct outbuf *b, char *end);
+static void see_frame(struct match *m, int type, const char *payload, int len);
+static void see_damage(struct client *p, bool powermove, int damage);
+static void see_status(struct match *m);
+static void see_chat(struct client *p, const char *message, int len);
+static void see_result(struct client *winner, struct client *loser, bool dropped);
+static void see_push(struct match *m);
+static void fan_out(void);
+static void fan_out_match(struct match *m);
+int start_match(struct client *head, struct client *player, struct client *opponent, struct match *m);
 int find_opponent(struct client *head, struct client *p);
-int handle_player(struct client **head, struct client *p, int nbytes);
-int add_name(struct client *head, struct client *p, int nbytes);
-int find_network_newline(char *buf, int inbuf);
+static int engage(struct client *head, struct client *p, struct client *opponent);
+static struct client *nearest_opponent(struct client *p);
+static struct client *bucket_opponent(struct client *p, int b, int reach);
+static int rating_bucket(int rating);
+static int bucket_above(int b);
+static int bucket_below(int b);
+static void rating_add(struct client *p);
+static void rating_remove(struct client *p);
+static void update_ratings(struct client *winner, struct client *loser);
+static int expected_score(int diff);
+int handle_player(struct client **head, struct client *p);
+int add_name(struct client *head, struct client *p);
+static int enter_arena(struct client *head, struct client *p);
+static int handle_frame(struct client **head, struct client *p);
+static bool next_frame(struct client *p, int *type, char *payload, int *len);
+static int queue_frame(struct client *p, int type, const void *payload, int len);
+int find_network_newline(struct client *p);
+static int next_line(struct client *p, char *line, int size);
+static void consume_input(struct client *p, unsigned int n);
 static struct client *addclient(struct client *top, int fd, struct in_addr addr);
 static struct client *removeclient(struct client **top, struct client *p);
-static void broadcast(struct client *top, char *s, int size, struct client *source);
-struct client *move_to_end(struct client **head, struct client *p);
+static void broadcast(struct client *top, const char *rest, int type, struct client *source);
+static void wait_push(struct client *p);
+static void wait_remove(struct client *p);
 int handleclient(struct client *p, struct client *top);
 int bindandlisten(void);
+static void acceptclient(int listenfd);
+static bool shed_connection(int listenfd);
+static void newclient(int clientfd, struct in_addr addr);
+static bool watchclient(struct client *p);
+static void readclient(struct client *p);
+static bool process_input(struct client *p);
+static bool take_input(struct client *p, const char *data, int len);
+static void dropclient(struct client *p, enum drop_reason why);
+static bool inbuf_attach(struct client *p);
+static void inbuf_release(struct client *p);
+static long rate_capacity(enum rate_kind kind);
+static void rate_fill(struct client *p);
+static void rate_refill(struct client *p);
+static void rate_charge(struct client *p, enum rate_kind kind, int n);
+static bool rate_exceeded(struct client *p);
+static uint64_t rate_wait(struct client *p);
+static bool throttle(struct client *p);
+static void watch_input(struct client *p, bool on);
+static int set_name(struct client *p, const char *name, int len);
+static struct client *lookupclient(int fd);
+static void list_append(struct client **top, struct client *p);
+static void list_unlink(struct client **top, struct client *p);
+int queue_output(struct client *p, const char *s, int size);
+static int queue_shared(struct client *p, struct outbuf *b);
+static char *out_begin(struct client *p, int max);
+static void out_end(struct client *p, char *end);
+static char *put_bytes(char *at, const char *s, int len);
+static char *put_name(char *at, struct client *who);
+static char *put_int(char *at, int n);
+static char *put_u64(char *at, uint64_t n);
+static struct outbuf *outbuf_new(int cap);
+static void outbuf_release(struct outbuf *b);
+static struct outseg *outseg_append(struct client *p, struct outbuf *b);
+static int flushclient(struct client *p);
+static void output_sent(struct client *p, int nbytes);
+static void flush_dirty(void);
+static void dirty_push(struct client *p);
+static void dirty_remove(struct client *p);
+static void free_output(struct client *p);
+static void out_count(struct client *p, long n);
+static bool out_backlogged(struct client *p);
+static bool out_overflowing(struct client *p);
+static void *run_shard(void *arg);
+static void epoll_loop(void);
+static bool uring_init(void);
+static bool uring_fail(const char *what);
+static void uring_loop(void);
+static void uring_enter(bool wait, int timeout_ms);
+static struct io_uring_sqe *uring_sqe(void);
+static int uring_reap(void);
+static void uring_complete(const struct io_uring_cqe *cqe);
+static void uring_accept(void);
+static void uring_accepted(int res);
+static void uring_watch_inbox(void);
+static void uring_recv(struct client *p);
+static void uring_received(int fd, uint32_t id, int res, unsigned int flags);
+static void uring_recycle(int bid);
+static int uring_send(struct client *p);
+static void uring_sent(struct sendreq *req, int res);
+static void uring_cancel(struct client *p);
+static void uring_move(struct client *p);
+static void setclient(int fd, struct client *p);
+static void queue_link(struct client **qhead, struct client **qtail, struct client *p);
+static void queue_unlink(struct client **qhead, struct client **qtail, struct client *p);
+static bool handoff(struct client *p);
+static void send_leaving(void);
+static void move_client(struct client *p, struct shard *to);
+static void adoptclient(struct client *p);
+static void rebalance(void);
+static void post(struct shard *to, enum shard_msg_type type, struct client *p,
+                 struct outbuf *b, struct outbuf *bin);
+static void read_inbox(void);
+static void *pool_get(struct pool *pl);
+static void pool_put(struct pool *pl, void *obj);
+static void end_of_match(struct client *a, struct client *b);
+static uint64_t splitmix64(uint64_t *x);
+static void rng_seed(struct rng *r, uint64_t seed);
+static uint64_t rng_next(struct rng *r);
+static int rng_range(struct rng *r, int lo, int hi);
+static void battle_start(struct battle *b, uint64_t seed);
+static void battle_move(struct battle *b, bool powermove, struct battle_event *ev);
+static void simulate(long matches);
+static void *run_sim(void *arg);
+static uint64_t now_ns(void);
+static void timer_arm(struct timer *t, uint64_t ticks);
+static void timer_cancel(struct timer *t);
+static void timer_insert(struct timer *t);
+static void timer_init(struct timer *t, struct client *owner, enum timer_kind kind);
+static void run_timers(void);
+static void cascade(int level, int slot);
+static int next_timeout(void);
+static void timer_expired(struct timer *t);
+static void idle_expired(struct client *p);
+static void turn_expired(struct client *p);
+static void match_expired(struct client *p);
+static void throttle_expired(struct client *p);
+static void observe(atomic_ulong *hist, const uint64_t *bounds, int nbounds, uint64_t v);
+static void record_result(struct client *winner, struct client *loser);
+static void stats_post(struct client *p, bool won, int dealt, int taken);
+static bool stats_lookup(const char *name, int len, struct stats_record *out);
+static int stats_top(struct leader *top);
+static int print_record(struct client *p, const struct stats_record *r);
+static int print_top(struct client *p);
+static void stats_open(void);
+static void stats_replay(void);
+static void *run_stats(void *arg);
+static void stats_write(const struct stats_record *recs, int n);
+static bool write_all(int fd, const void *data, size_t len);
+static void stats_checkpoint(void);
+static void stats_compact(void);
+static struct stats_entry *stats_find(const char *name, int len, uint64_t hash);
+static void stats_apply(struct stats_entry *e, const struct stats_record *r);
+static uint64_t stats_hash(const char *name, int len);
+static uint32_t record_check(const struct stats_record *r);
+static void leader_update(int slot);
+static void leaders_publish(void);
+static void *run_restart(void *arg);
+static void hand_over(int sock);
+static bool send_sessions(int sock);
+static bool send_handover(int sock, struct session_ref *refs, int n);
+static void image_session(struct session_image *img, struct session_ref *ref,
+                          struct session_ref *refs, int n);
+static int session_index(struct session_ref *refs, int n, struct client *p);
+static int compare_refs(const void *a, const void *b);
+static void take_over(void);
+static void restoreclient(struct client *p);
+static void freeze(void);
+static bool quiet(void);
+static void thaw(void);
+static bool restart_send(int sock, const void *data, size_t len, const int *fds, int nfds);
+static ssize_t restart_recv(int sock, void *data, size_t size, int *fds, int *nfds);
+static void *run_admin(void *arg);
+static void write_metrics(FILE *f);
+static void trace_record(enum trace_kind kind, uint64_t start, uint64_t end, uint64_t arg);
+static void write_trace(FILE *f);
+static void *run_trace(void *arg);
+static long long sum_shards(size_t offset);
+static void write_histogram(FILE *f, const char *name, const char *help,
+                            size_t hist, size_t count, size_t sum,
+                            const uint64_t *bounds, int nbounds);
 
 
-struct client *head = NULL;
+struct shard *shards = NULL; // one per event-loop thread
+int nshards = 1;
+atomic_ulong next_id = 1;    // id for the next connection on any shard
+bool fixed_seed = false;     // true if -s was given
+uint64_t base_seed;          // the -s value
+bool verbose = false;        // -v: log every connection and match seed
+uint64_t turn_ticks = TURN_TIMEOUT * TICKS_PER_SEC; // -T
+uint64_t name_ticks = NAME_TIMEOUT * TICKS_PER_SEC; // -N
+uint64_t idle_ticks = IDLE_TIMEOUT * TICKS_PER_SEC; // -I
+int backlog = SOMAXCONN;     // -b: listen() backlog of each shard's listener
+bool want_uring = false;     // -u: run the shards on io_uring where the kernel allows
+const char *stats_path = NULL; // -S: where the stats log and index live; NULL keeps them in memory
+const char *restart_path = NULL; // -H: the restart socket, NULL if hot restarts are off
+bool rating_mode = false;    // -r: pair waiting players by rating instead of oldest first
+long sim_matches = 0;        // -B: battles to simulate instead of serving, 0 to serve
+long output_limit = OUTPUT_LIMIT;   // -o: unsent bytes one client may have, 0 for no limit
+long output_budget = OUTPUT_BUDGET; // -O: unsent bytes all clients may have, 0 for no limit
+long rate_limits[NRATES] = { INPUT_RATE, COMMAND_RATE, CHAT_RATE }; // -k, -l, -c: per second, 0 for no limit
+int admin_fd = -1;           // the admin listener, which a hot restart passes on
 
-int main(void) {
-    int clientfd, maxfd, nready;
-    struct client *p;
-    head = NULL;
-    socklen_t len;
-    struct sockaddr_in q;
-    fd_set allset;
-    fd_set rset;
+// a hot restart in progress. The shards wait here while the handover runs
+pthread_mutex_t restart_lock = PTHREAD_MUTEX_INITIALIZER; // guards the next four
+pthread_cond_t restart_cond = PTHREAD_COND_INITIALIZER;
+bool if_frozen = false;      // true if the shards must wait for the handover false otherwise
+int nfrozen = 0;             // shards waiting
+int stats_holding = 0;       // 1 once the stats writer is asked to stop, 2 once it has
+
+// the player stats store. Shards read the index and the leaderboard and
+// push results onto stats_inbox; everything else belongs to the writer thread
+struct stats_header *stats_hdr = NULL;   // the start of the index mapping
+struct stats_entry *stats_slots = NULL;  // STATS_SLOTS slots following the header
+_Atomic(struct stats_update *) stats_inbox = NULL; // lock-free stack of results to record
+struct leaderboard leaders;
+atomic_long stats_players = 0;           // slots in use
+atomic_ulong stats_records = 0;          // records appended to the log
+atomic_ulong stats_syncs = 0;            // fdatasync() calls on the log
+int stats_log = -1;                      // the log, -1 without -S
+uint64_t stats_log_size = 0;             // bytes of whole records in the log
+int top_slots[TOP_N];                    // the writer's leaderboard, as slots, best first
+int ntop = 0;
+struct stats_record *stats_batch = NULL; // the writer's batch of new totals, oldest first
+int *stats_batch_slot = NULL;            // the slot each of them goes to
+int stats_batch_cap = 0;
+int *stats_pending = NULL;               // per slot: 1 + its latest record in the batch, 0 if none
+
+// each shard's own state; only its thread touches these
+__thread struct shard *self = NULL;    // the shard this thread runs
+__thread struct client *head = NULL;
+__thread struct client *tail = NULL; // last client in the list, so appending is O(1)
+__thread struct client **clients = NULL; // clients[fd] is the client reading from fd
+__thread int maxclients = 0;             // number of slots in clients
+__thread struct client *waithead = NULL; // players waiting for an opponent, oldest first
+__thread struct client *waittail = NULL;
+__thread struct client *bucket_head[RATING_BUCKETS]; // (-r) waiting players by rating, oldest first
+__thread struct client *bucket_tail[RATING_BUCKETS];
+__thread uint64_t bucket_bits[RATING_BUCKETS / 64]; // a bit for every bucket that has anybody in it
+__thread struct client *leavehead = NULL; // players to hand to another shard this iteration
+__thread struct client *leavetail = NULL;
+__thread struct client *dirtyhead = NULL; // players with queued output to flush this iteration
+__thread struct match *seenhead = NULL;   // matches with events for their spectators this iteration
+__thread int epfd; // epoll instance watching the listening socket and every client
+__thread struct ring ring = { .fd = -1 }; // this shard's io_uring, if it runs on one
+__thread int reserve_fd = -1; // spare descriptor, given up to shed connections on EMFILE
+// recycled sessions and output memory; whichever shard frees an object keeps it
+__thread struct pool client_pool = { NULL, sizeof(struct client) };
+__thread struct pool outbuf_pool = { NULL, sizeof(struct outbuf) + OUTBUF_SIZE };
+__thread struct pool outseg_pool = { NULL, sizeof(struct outseg) };
+__thread struct pool match_pool = { NULL, sizeof(struct match) };
+__thread struct pool sendreq_pool = { NULL, sizeof(struct sendreq) };
+__thread struct pool inbuf_pool = { NULL, BUF_SIZE };
+__thread struct pool name_pool = { NULL, NAME_SIZE };
+__thread uint64_t seed_state; // this shard's source of match seeds
+__thread struct timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS]; // armed timers by level and slot
+__thread uint64_t wheel_now; // last tick the wheel has run
+__thread int ntimers;        // armed timers; when 0 the loop may sleep indefinitely
+__thread bool freezing = false;  // true if the shard is stopping for a hot restart false otherwise
+__thread bool accepting = false; // true if a multishot accept is armed on the ring false otherwise
+__thread bool output_tight = false; // true if output as a whole was over budget at the last flush false otherwise
+
+int main(int argc, char **argv) {
+    int opt, i;
+    int admin_port = ADMIN_PORT;
     
-    int i;
+    nshards = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "t:s:m:vT:N:I:b:uS:H:rB:o:O:k:l:c:")) != -1) {
+        switch (opt) {
+        case 't':
+            nshards = atoi(optarg);
+            break;
+        case 's':
+            fixed_seed = true;
+            base_seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            admin_port = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'T':
+            turn_ticks = atoi(optarg) * TICKS_PER_SEC;
+            break;
+        case 'N':
+            name_ticks = atoi(optarg) * TICKS_PER_SEC;
+            break;
+        case 'I':
+            idle_ticks = atoi(optarg) * TICKS_PER_SEC;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'u':
+            want_uring = true;
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'H':
+            if (strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+                fprintf(stderr, "%s: restart socket path too long\n", argv[0]);
+                exit(1);
+            }
+            restart_path = optarg;
+            break;
+        case 'r':
+            rating_mode = true;
+            break;
+        case 'B':
+            sim_matches = atol(optarg);
+            break;
+        case 'o':
+            output_limit = atol(optarg) << 10;
+            break;
+        case 'O':
+            output_budget = atol(optarg) << 20;
+            break;
+        case 'k':
+            rate_limits[RATE_BYTES] = atol(optarg) << 10;
+            break;
+        case 'l':
+            rate_limits[RATE_COMMANDS] = atol(optarg);
+            break;
+        case 'c':
+            rate_limits[RATE_CHAT] = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-s seed] [-m admin port] [-v]"
+                    " [-T turn secs] [-N name secs] [-I idle secs] [-b backlog] [-u]"
+                    " [-S stats path] [-H restart socket] [-r]"
+                    " [-o output KB] [-O output budget MB]"
+                    " [-k input KB/sec] [-l lines/sec] [-c chat lines/sec]\n"
+                    "       %s -B matches [-t threads] [-s seed]\n", argv[0], argv[0]);
+            exit(1);
+        }
+    }
+    if (nshards < 1) {
+        nshards = 1;
+    }
+    if (sim_matches > 0) {
+        simulate(sim_matches);
+        return 0;
+    }
     
+    // a peer closing mid-write should fail writev() with EPIPE, not kill us
+    signal(SIGPIPE, SIG_IGN);
     
-    int listenfd = bindandlisten();
-    // initialize allset and add listenfd to the
-    // set of file descriptors passed into select
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    // maxfd identifies how far into the set to search
-    maxfd = listenfd;
+    // SIGUSR1 dumps the flight recorder. Block it before any thread starts,
+    // so every thread inherits the mask and only run_trace() sees it
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
     
-    while (1) {
-        // make a copy of the set before we pass it into select
-        rset = allset;
-
-        
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-        
-        if (nready == -1) {
-            perror("select");
-            continue;
+    // every player needs a descriptor: take as many as we are allowed
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    
+    // every shard gets its own listener before any of them starts serving
+    // shards are cache-line aligned so their counters don't false-share
+    if (posix_memalign((void **)&shards, 64, nshards * sizeof(struct shard)) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(shards, 0, nshards * sizeof(struct shard));
+    for (i = 0; i < nshards; i++) {
+        shards[i].index = i;
+        shards[i].listenfd = -1;
+        if ((shards[i].wakefd = eventfd(0, EFD_NONBLOCK)) == -1) {
+            perror("eventfd");
+            exit(1);
         }
-        
-        if (FD_ISSET(listenfd, &rset)){
-            printf("a new client is connecting\n");
-            len = sizeof(q);
-            if ((clientfd = accept(listenfd, (struct sockaddr *)&q, &len)) < 0) {
-                perror("accept");
-                exit(1);
-            }
-            FD_SET(clientfd, &allset);
-            if (clientfd > maxfd) {
-                maxfd = clientfd;
-            }
-            printf("connection from %s\n", inet_ntoa(q.sin_addr));
-            head = addclient(head, clientfd, q.sin_addr); // name not added yet
+        atomic_init(&shards[i].inbox, NULL);
+        atomic_init(&shards[i].nwaiting, 0);
+        // untouched pages cost nothing until the shard gets round to them
+        if ((shards[i].trace = calloc(TRACE_EVENTS, sizeof(struct trace_event))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
         }
-        
-        for(i = 0; i <= maxfd; i++) {
-            if (FD_ISSET(i, &rset)) {
-                for (p = head; p != NULL; p = p->next) {
-                    if (p->fd == i) {
-                        int nbytes;
-                        int room = 200 - p->inbuf;
-                        char *after = &p->buf[p->inbuf]; // pointer to current position in p.buf
-                        if ((nbytes = read(p->fd, after, room)) <= 0) {
-                            int tmp_fd = p->fd;
-                            head = removeclient(&head, p);
-                            FD_CLR(tmp_fd, &allset);
-                            close(tmp_fd);
-                            break;
-                        }
-                        
-                        int result = handle_player(&head, p, nbytes);
-                        //int result = handleclient(p, head);
-                        if (result == -1) { // player drops
-                            int tmp_fd = p->fd;
-                            head = removeclient(&head, p);
-                            FD_CLR(tmp_fd, &allset);
-                            close(tmp_fd);
-                            break;
-                        }
-                        else if (result == -2) { // opponent drops
-                            int tmp_fd = p->opponent->fd;
-                            head = removeclient(&head, p->opponent);
-                            FD_CLR(tmp_fd, &allset);
-                            close(tmp_fd);
-                            break;
-                        }
-                        break;
-                    }
-                }
-            }
+        atomic_init(&shards[i].trace_head, 0);
+    }
+    // a hot restart inherits the running server's listeners and players
+    if (restart_path != NULL) {
+        take_over();
+    }
+    for (i = 0; i < nshards; i++) {
+        if (shards[i].listenfd == -1) {
+            shards[i].listenfd = bindandlisten();
         }
     }
-    return 0;
-}
-
-/* Call an appropriate fucnction depending on the player's input */
-int handle_player(struct client **head, struct client *p, int nbytes) {
-    //fprintf(stderr, "name: %s, buf: %s, command: %c, inbuf: %d\n", p->name, p->buf, p->command, p->inbuf);
-    
-    // add a name of the player
-    if (p->if_name == false) {
-        return add_name(*head, p, nbytes);
+    stats_open();
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, run_stats, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(1);
     }
-    
-    // clears buffer when inactive player inputs something
-    else if (p->if_active == false) {
-        p->inbuf = 0;
+    if (admin_port != 0) {
+        pthread_t admin;
+        if (pthread_create(&admin, NULL, run_admin, (void *)(long)admin_port) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    } else if (admin_fd != -1) {
+        close(admin_fd);
+        admin_fd = -1;
     }
-    
-    // get a command from an active player and process it
-    else if (p->if_active == true && p->command == '\0') {
-        return get_command(head, p, nbytes);
+    pthread_t tracer;
+    if (pthread_create(&tracer, NULL, run_trace, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(1);
     }
-    
-    // handle speak
-    else if (p->if_active == true && p->command == 's') {
-        return speak(p, nbytes);
+    if (restart_path != NULL) {
+        pthread_t restarter;
+        if (pthread_create(&restarter, NULL, run_restart, NULL) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
     }
-    
+    for (i = 1; i < nshards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    run_shard(&shards[0]);
     return 0;
 }
 
-/* respond to active player's action */
-int handle_command(struct client **head, struct client *p) {
-    char buf[200];
+/* the event loop of one shard */
+static void *run_shard(void *arg) {
+    self = arg;
+    // each shard draws match seeds from its own splitmix64 sequence
+    if (fixed_seed == true) {
+        seed_state = base_seed + self->index * 0x9e3779b97f4a7c15ULL;
+    } else if (getrandom(&seed_state, sizeof(seed_state), 0) != sizeof(seed_state)) {
+        seed_state = time(NULL) ^ ((uint64_t)self->index << 32);
+    }
+    wheel_now = now_ns() / TICK_NS;
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (want_uring == true && uring_init() == true) {
+        uring_loop();
+    } else {
+        epoll_loop();
+    }
+    return NULL;
+}
+
+/* the readiness loop: epoll says which descriptors to read and write */
+static void epoll_loop(void) {
+    int nready;
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+    int i;
     
-    srand(time(NULL)); // initialize rand
-    int rand_attack = (rand()%(6+1-2))+2; // randomly pick attack
+    // create the epoll instance and register the listener and inbox with it.
+    // Both stay level-triggered, so a listener with connections left over
+    // after one batch of accepts wakes us again
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = self->listenfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, self->listenfd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.data.fd = self->wakefd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, self->wakefd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
     
-    // handle (a)
-    if (p->command == 'a') {
-        p->opponent->hitpoints = p->opponent->hitpoints - rand_attack;
+    while (1) {
+        // only the descriptors that are ready come back. Wake up for the
+        // next tick if any timer is armed
+        nready = epoll_wait(epfd, events, MAX_EVENTS, next_timeout());
+        uint64_t start = now_ns();
         
-        // print to the player
-        sprintf(buf, "\nYou hit %s for %d damage!\n", p->opponent->name, rand_attack);
-        if (write(p->fd, buf, strlen(buf)) == -1) {
-            return -1;
-        }
-        // print to the opponent
-        sprintf(buf, "%s hits you for %d damage!\n", p->name, rand_attack);
-        if (write(p->opponent->fd, buf, strlen(buf)) == -1) {
-            return -2;
+        if (nready == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            nready = 0;
         }
-    }
-    
-    // handle (p)
-    else if (p->command == 'p') {
-        int rand_powermove = rand()%2; // randomly decide if the powermove hits
-        p->powermoves--;
         
-        if (rand_powermove == 1) {
-            rand_attack = rand_attack * 3;
-            p->opponent->hitpoints = p->opponent->hitpoints - rand_attack;
-            
-            // print to the player
-            sprintf(buf, "\nYou hit %s for %d damage!\n", p->opponent->name, rand_attack);
-            if (write(p->fd, buf, strlen(buf)) == -1) {
-                return -1;
+        for (i = 0; i < nready; i++) {
+            if (events[i].data.fd == self->listenfd) {
+                acceptclient(self->listenfd);
+                continue;
             }
-            // print to the opponent
-            sprintf(buf, "%s powermoves you for %d damage!\n", p->name, rand_attack);
-            if (write(p->opponent->fd, buf, strlen(buf)) == -1) {
-                return -2;
+            if (events[i].data.fd == self->wakefd) {
+                read_inbox();
+                continue;
             }
-        } else {
-            // print to the player
-            sprintf(buf, "\nYou missed!\n");
-            if (write(p->fd, buf, strlen(buf)) == -1) {
-                return -1;
+            struct client *p = lookupclient(events[i].data.fd);
+            if (p == NULL) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) { // room in the socket buffer again
+                p->if_blocked = false;
+                if (p->outhead != NULL) {
+                    dirty_push(p);
+                }
             }
-            // print to the opponent
-            sprintf(buf, "%s missed you!\n", p->name);
-            if (write(p->opponent->fd, buf, strlen(buf)) == -1) {
-                return -2;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                readclient(p);
             }
         }
+        run_timers();
+        if (freezing == true) {
+            freeze(); // returns only if the hot restart fell through
+        }
+        
+        // send everything this iteration produced, one writev per client,
+        // then give spectators the match events (after the fighters' own
+        // output is on its way) and pass on the players that are moving to
+        // another shard
+        while (dirtyhead != NULL || seenhead != NULL || leavehead != NULL) {
+            flush_dirty();
+            fan_out();
+            send_leaving();
+        }
+        trace_record(TRACE_LOOP, start, now_ns(), nready);
     }
+}
+
+/* Set up this shard's io_uring with its provided receive buffers, and
+ * start accepting and watching the inbox. Returns false (the shard then
+ * runs on epoll) if the kernel lacks something the backend needs.
+ */
+static bool uring_init(void) {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    int i;
     
-    // when p beats the opponent
-    if (p->opponent->hitpoints <= 0) {
-        return end_match(head, p);
+    memset(&params, 0, sizeof(params));
+    // only this thread submits, and completions are only looked at when
+    // it enters the kernel to wait for them anyway
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+                   | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = RING_CQ_ENTRIES;
+    ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring.fd < 0 && errno == EINVAL) { // an older kernel: no tuning
+        params.flags = IORING_SETUP_CQSIZE;
+        ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    }
+    if (ring.fd < 0) {
+        return uring_fail("io_uring_setup");
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0
+        || (params.features & IORING_FEAT_EXT_ARG) == 0
+        || (params.features & IORING_FEAT_NODROP) == 0) {
+        errno = ENOSYS;
+        return uring_fail("io_uring features");
     }
     
-    // print status on player's side
-    if (print_status(p) == -1 || print_inactive_player(p) == -1) {
-        return -1;
+    // both queues share one mapping; the SQEs have their own
+    ring.rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring.rings_size) {
+        ring.rings_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
     }
-    // print status on opponent's side
-    if (print_status(p->opponent) == -1 || print_active_player(p->opponent) == -1) {
-        return -2;
+    ring.rings = mmap(NULL, ring.rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQ_RING);
+    if (ring.rings == MAP_FAILED) {
+        ring.rings = NULL;
+        return uring_fail("mmap");
     }
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        return uring_fail("mmap");
+    }
+    ring.sq_head = (unsigned int *)((char *)ring.rings + params.sq_off.head);
+    ring.sq_tail = (unsigned int *)((char *)ring.rings + params.sq_off.tail);
+    ring.sq_mask = (unsigned int *)((char *)ring.rings + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)((char *)ring.rings + params.sq_off.array);
+    ring.cq_head = (unsigned int *)((char *)ring.rings + params.cq_off.head);
+    ring.cq_tail = (unsigned int *)((char *)ring.rings + params.cq_off.tail);
+    ring.cq_mask = (unsigned int *)((char *)ring.rings + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.rings + params.cq_off.cqes);
+    ring.sq_entries = params.sq_entries;
+    ring.tail = *ring.sq_tail;
     
-    // flip the side
-    p->command = '\0'; // initialize command for the next action
-    p->if_active = false;
-    p->opponent->if_active = true;
+    // the buffers multishot receives pick from, all in buffer group 0
+    ring.br = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.br == MAP_FAILED) {
+        ring.br = NULL;
+        return uring_fail("mmap");
+    }
+    if ((ring.bufs = malloc(RECV_BUFS * RECV_BUF_SIZE)) == NULL) {
+        return uring_fail("malloc");
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring.br;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return uring_fail("io_uring_register");
+    }
+    ring.br_tail = 0;
+    for (i = 0; i < RECV_BUFS; i++) {
+        uring_recycle(i);
+    }
     
-    return 0;
+    uring_accept();
+    uring_watch_inbox();
+    return true;
 }
 
-/* read the player's input till find a valid command and return it
- * return -1 if fails
- */
-char get_command(struct client **head, struct client *p, int nbytes) {
-    int where; // location of a valid command
-    p->inbuf = p->inbuf + nbytes; // update inbuf
+/* undo a half-done uring_init() and say why the shard falls back to epoll */
+static bool uring_fail(const char *what) {
+    fprintf(stderr, "shard %d: %s: %s; using epoll\n", self->index, what, strerror(errno));
+    if (ring.br != NULL) {
+        munmap(ring.br, RECV_BUFS * sizeof(struct io_uring_buf));
+        ring.br = NULL;
+    }
+    free(ring.bufs);
+    ring.bufs = NULL;
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sq_entries * sizeof(struct io_uring_sqe));
+        ring.sqes = NULL;
+    }
+    if (ring.rings != NULL) {
+        munmap(ring.rings, ring.rings_size);
+        ring.rings = NULL;
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    ring.fd = -1;
+    return false;
+}
 
-    where = find_valid_command(p);
-    
-    if (where >= 0) { // have complete name
-        p->command = p->buf[where];
-        p->inbuf = 0;
-        if (p->command != 's') {
-            return handle_command(head, p);
+/* The completion loop: every request the last iteration queued goes to the
+ * kernel in the same io_uring_enter() that waits for the next completions.
+ */
+static void uring_loop(void) {
+    while (1) {
+        // wake up for the next tick if any timer is armed
+        uring_enter(true, next_timeout());
+        uint64_t start = now_ns();
+        int ncompleted = uring_reap();
+        run_timers();
+        if (freezing == true) {
+            freeze(); // returns only if the hot restart fell through
         }
-        else if (p->command == 's') {
-            char outbuf[200];
-            // print to p
-            sprintf(outbuf, "\nSpeak: \n");
-            if (write(p->fd, outbuf, strlen(outbuf)) == -1) {
-                return -1;
-            }
-            return 0;
+        
+        // queue a send for every client with output, the fighters' before
+        // any spectator's, then pass on the players that are moving to
+        // another shard
+        while (dirtyhead != NULL || seenhead != NULL || leavehead != NULL) {
+            flush_dirty();
+            fan_out();
+            send_leaving();
         }
+        trace_record(TRACE_LOOP, start, now_ns(), ncompleted);
     }
-    return 0;
 }
 
-/* find the position of 'a', 's' or 'p' in the player's input*/
-int find_valid_command(struct client *p) {
-    int i = 0;
-    while (i < p->inbuf) {
-        if (p->buf[i] == 'a' || p->buf[i] == 's' || (p->buf[i] == 'p' && p->powermoves != 0)) {
-            return i;
+/* Submit the SQEs queued since the last call and, if wait is true, wait
+ * for a completion or until timeout_ms (-1: no limit) have passed.
+ */
+static void uring_enter(bool wait, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = 0;
+    unsigned int submit;
+    
+    __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+    submit = ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    memset(&arg, 0, sizeof(arg));
+    if (wait == true) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+            arg.ts = (uintptr_t)&ts;
         }
-        i++;
     }
-    return -1;
+    STAT_ADD(ring_enters, 1);
+    if (syscall(__NR_io_uring_enter, ring.fd, submit, wait == true ? 1 : 0, flags,
+                wait == true ? &arg : NULL, sizeof(arg)) == -1
+        && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+        perror("io_uring_enter");
+    }
 }
 
-/* notifies the players of the end of this match and rearrange the list */
-int end_match(struct client **head, struct client *p) {
-    char buf[200];
-    // notifies to p
-    sprintf(buf, "%s gives up. You win!\n\n", p->opponent->name);
-    if (write(p->fd, buf, strlen(buf)) == -1) {
-        return -1;
+/* Return a cleared SQE to fill in; it goes to the kernel with the rest of
+ * the batch. If the queue is full, what is in it is submitted first.
+ */
+static struct io_uring_sqe *uring_sqe(void) {
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+    
+    while (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        uring_enter(false, -1);
     }
-    // notifies to opponent
-    sprintf(buf, "You are no match for %s. You scurry away...\n\n", p->name);
-    if (write(p->opponent->fd, buf, strlen(buf)) == -1) {
-        return -2;
+    index = ring.tail & *ring.sq_mask;
+    sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    ring.tail++;
+    return sqe;
+}
+
+/* handle every completion the kernel has posted */
+static int uring_reap(void) {
+    unsigned int at = *ring.cq_head;
+    unsigned int start = at;
+    unsigned int end;
+    
+    while (at != (end = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))) {
+        while (at != end) {
+            // copy it out, so the slot can be handed back before handling it
+            struct io_uring_cqe cqe = ring.cqes[at & *ring.cq_mask];
+            at++;
+            __atomic_store_n(ring.cq_head, at, __ATOMIC_RELEASE);
+            uring_complete(&cqe);
+        }
     }
+    return at - start;
+}
+
+/* act on one completion. A multishot request that comes back without
+ * IORING_CQE_F_MORE has stopped and is armed again
+ */
+static void uring_complete(const struct io_uring_cqe *cqe) {
+    uint64_t rest = cqe->user_data & ((1ULL << 56) - 1);
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
     
-    // update their status
-    p->in_match = false;
-    p->opponent->in_match = false;
+    switch (cqe->user_data >> 56) {
+    case RING_ACCEPT:
+        uring_accepted(cqe->res);
+        if (more == false) {
+            accepting = false;
+            uring_accept();
+        }
+        break;
+    case RING_WAKE:
+        if (cqe->res > 0) {
+            read_inbox();
+        }
+        if (more == false) {
+            uring_watch_inbox();
+        }
+        break;
+    case RING_RECV:
+        uring_received(rest >> 32, (uint32_t)rest, cqe->res, cqe->flags);
+        break;
+    case RING_SEND:
+        uring_sent((struct sendreq *)(uintptr_t)rest, cqe->res);
+        break;
+    default: // RING_CANCEL: the cancelled requests report for themselves
+        break;
+    }
+}
+
+/* keep one multishot accept armed on the listener */
+static void uring_accept(void) {
+    struct io_uring_sqe *sqe;
     
-    // put them at the end of the list
-    *head = move_to_end(head, p);
-    *head = move_to_end(head, p->opponent);
+    if (freezing == true) {
+        return;
+    }
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = self->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = RING_DATA(RING_ACCEPT, 0);
+    accepting = true;
+}
+
+/* the multishot accept produced a connection (res is its fd) or an error */
+static void uring_accepted(int res) {
+    struct sockaddr_in q;
+    socklen_t len = sizeof(q);
     
-    // find new opponents
-    sprintf(buf, "Awaiting next opponent...\n");
-    if (write(p->fd, buf, strlen(buf)) == -1) {
+    if (res == -EMFILE || res == -ENFILE) {
+        shed_connection(self->listenfd);
+        return;
+    }
+    if (res < 0) {
+        return; // the peer gave up, or the accept is re-armed below
+    }
+    // one address buffer can't serve a multishot accept; ask for it instead
+    if (getpeername(res, (struct sockaddr *)&q, &len) == -1) {
+        q.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    newclient(res, q.sin_addr);
+}
+
+/* keep one multishot poll armed on the inbox eventfd */
+static void uring_watch_inbox(void) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = self->wakefd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = RING_DATA(RING_WAKE, 0);
+}
+
+/* arm a multishot recv for p; the kernel picks a provided buffer for
+ * every chunk it receives
+ */
+static void uring_recv(struct client *p) {
+    struct io_uring_sqe *sqe;
+    
+    if (freezing == true) {
+        return; // thaw() arms it again if the hot restart falls through
+    }
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = p->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = RING_DATA(RING_RECV, (uint64_t)p->fd << 32 | (uint32_t)p->id);
+    p->if_receiving = true;
+}
+
+/* A recv for fd completed: hand the bytes to the client and the buffer
+ * back to the kernel. The id tells a late completion for a client that has
+ * been dropped (its fd perhaps reused since) from one for the current one.
+ */
+static void uring_received(int fd, uint32_t id, int res, unsigned int flags) {
+    struct client *p = lookupclient(fd);
+    int bid = -1;
+    
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    if (p == NULL || (uint32_t)p->id != id) {
+        if (bid >= 0) {
+            uring_recycle(bid);
+        }
+        return;
+    }
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+        p->if_receiving = false;
+    }
+    if (res > 0 && bid >= 0) {
+        bool alive = take_input(p, &ring.bufs[bid * RECV_BUF_SIZE], res);
+        uring_recycle(bid);
+        if (alive == false) {
+            return;
+        }
+    } else {
+        if (bid >= 0) {
+            uring_recycle(bid);
+        }
+        if (res == 0) {
+            dropclient(p, DROP_PEER_CLOSED);
+            return;
+        }
+        // out of buffers for a moment, or cancelled for a move: not fatal
+        if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+            dropclient(p, DROP_READ_ERROR);
+            return;
+        }
+    }
+    if (p->move_to != NULL) {
+        uring_move(p);
+    } else if (p->if_receiving == false && p->if_throttled == false) {
+        uring_recv(p);
+    }
+}
+
+/* give provided buffer bid back to the kernel */
+static void uring_recycle(int bid) {
+    struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (RECV_BUFS - 1)];
+    b->addr = (uintptr_t)&ring.bufs[bid * RECV_BUF_SIZE];
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    ring.br_tail++;
+    __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+/* Queue one sendmsg for as much of p's output as fits in MAX_IOV chunks.
+ * A client has at most one send in flight; what is queued meanwhile goes
+ * when it completes (see uring_sent()). Returns -1 if memory runs out.
+ */
+static int uring_send(struct client *p) {
+    struct io_uring_sqe *sqe;
+    struct sendreq *req;
+    struct outseg *seg;
+    int n = 0;
+    
+    // a moving client's output goes with it, and so does a freezing shard's
+    if (p->outhead == NULL || p->if_blocked == true || p->move_to != NULL || freezing == true) {
+        return 0;
+    }
+    if ((req = pool_get(&sendreq_pool)) == NULL) {
+        perror("malloc");
         return -1;
     }
-    if (write(p->opponent->fd, buf, strlen(buf)) == -1) {
-        return -2;
+    for (seg = p->outhead; seg != NULL && n < MAX_IOV; seg = seg->next) {
+        req->iov[n].iov_base = &seg->buf->data[seg->start];
+        req->iov[n].iov_len = seg->buf->len - seg->start;
+        req->bufs[n] = seg->buf;
+        atomic_fetch_add_explicit(&seg->buf->refs, 1, memory_order_relaxed);
+        n++;
     }
-	find_opponent(*head, p->opponent);
-    find_opponent(*head, p);
+    req->nbufs = n;
+    req->fd = p->fd;
+    req->id = p->id;
+    memset(&req->msg, 0, sizeof(req->msg));
+    req->msg.msg_iov = req->iov;
+    req->msg.msg_iovlen = n;
     
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = p->fd;
+    sqe->addr = (uintptr_t)&req->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = RING_DATA(RING_SEND, (uintptr_t)req);
+    p->if_blocked = true;
     return 0;
 }
 
-/* handle when the player selects (s)peak */
-int speak(struct client *p, int nbytes) {
-    char outbuf[200];
-    int where; // location of network newline
+/* a sendmsg completed: res bytes of the client's queue have been sent */
+static void uring_sent(struct sendreq *req, int res) {
+    struct client *p = lookupclient(req->fd);
+    int i;
+    
+    for (i = 0; i < req->nbufs; i++) {
+        outbuf_release(req->bufs[i]);
+    }
+    if (p != NULL && p->id != req->id) {
+        p = NULL; // dropped while the send was in flight
+    }
+    pool_put(&sendreq_pool, req);
+    if (p == NULL) {
+        return;
+    }
+    p->if_blocked = false;
+    if (res < 0 && res != -ECANCELED) {
+        dropclient(p, DROP_WRITE_ERROR);
+        return;
+    }
+    if (res > 0) {
+        STAT_ADD(bytes_written, res);
+        output_sent(p, res);
+    }
+    if (p->move_to != NULL) {
+        uring_move(p);
+    } else if (p->outhead != NULL) {
+        dirty_push(p);
+    }
+}
+
+/* cancel every request the ring has in flight for p's socket */
+static void uring_cancel(struct client *p) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = p->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = RING_DATA(RING_CANCEL, 0);
+}
+
+/* p is moving to another shard: once the ring has nothing of it left in
+ * flight, finish the move send_leaving() started
+ */
+static void uring_move(struct client *p) {
+    if (p->if_receiving == false && p->if_blocked == false) {
+        struct shard *to = p->move_to;
+        p->move_to = NULL;
+        move_client(p, to);
+    }
+}
+
+/* accept every waiting connection (up to ACCEPT_BATCH) and register each
+ * with epoll (edge-triggered). The sockets are non-blocking; output that
+ * does not fit stays queued until epoll reports EPOLLOUT.
+ */
+static void acceptclient(int listenfd) {
+    int clientfd, n;
+    socklen_t len;
+    struct sockaddr_in q;
     
-    p->inbuf = p->inbuf + nbytes; // update inbuf
+    for (n = 0; n < ACCEPT_BATCH; n++) {
+        len = sizeof(q);
+        clientfd = accept4(listenfd, (struct sockaddr *)&q, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return; // drained
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                if (shed_connection(listenfd) == false) {
+                    return;
+                }
+                continue;
+            }
+            if (errno == ENOBUFS || errno == ENOMEM) {
+                return; // try again on the next pass
+            }
+            continue; // the peer gave up (ECONNABORTED and the like) or EINTR
+        }
+        newclient(clientfd, q.sin_addr);
+    }
+}
 
-    where = find_network_newline(p->buf, p->inbuf);
-    if (where >= 0) { // have complete message
-        p->buf[where] = '\0';
-        
-        // print to p
-        sprintf(outbuf, "You speak: %s\n", p->buf);
-        if (write(p->fd, outbuf, strlen(outbuf)) == -1) {
+/* Out of descriptors: use the spare one to take a connection off the queue
+ * and close it, rather than leave it hanging. Returns false if there is no
+ * spare descriptor to use.
+ */
+static bool shed_connection(int listenfd) {
+    int clientfd;
+    if (reserve_fd < 0) {
+        return false;
+    }
+    close(reserve_fd);
+    clientfd = accept(listenfd, NULL, NULL);
+    if (clientfd >= 0) {
+        close(clientfd);
+        STAT_ADD(accepts_shed, 1);
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return true;
+}
+
+/* set up a freshly accepted connection and start reading from it */
+static void newclient(int clientfd, struct in_addr addr) {
+    struct client *p;
+    int yes = 1;
+    
+    STAT_ADD(accepts, 1);
+    // replies are small and sent at once; don't let Nagle hold them back
+    setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if (verbose) {
+        printf("connection from %s\n", inet_ntoa(addr));
+    }
+    head = addclient(head, clientfd, addr); // name not added yet
+    if ((p = lookupclient(clientfd)) == NULL) {
+        // out of memory: turn this connection away, keep everybody else
+        close(clientfd);
+        STAT_ADD(disconnects[DROP_INTERNAL], 1);
+        return;
+    }
+    if (watchclient(p) == false) {
+        dropclient(p, DROP_INTERNAL);
+    }
+}
+
+/* Start reading from p: register it with epoll (edge-triggered, for input
+ * and room to write), or arm a multishot recv on the shard's ring.
+ * Returns false if epoll refuses the fd.
+ */
+static bool watchclient(struct client *p) {
+    struct epoll_event ev;
+    
+    if (ring.fd >= 0) {
+        uring_recv(p);
+        return true;
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = p->fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+/* read everything the client has sent. The fd is edge-triggered, so keep
+ * reading until the kernel has nothing left (EAGAIN).
+ */
+static void readclient(struct client *p) {
+    while (p->if_throttled == false) { // throttle_expired() reads on
+        int nbytes;
+        // the free part of the ring may wrap around the end of buf.
+        // handle_player() never leaves the ring full, so room > 0
+        unsigned int at = p->intail & (BUF_SIZE - 1);
+        unsigned int room = BUF_SIZE - (p->intail - p->inhead);
+        struct iovec iov[2];
+        if (inbuf_attach(p) == false) {
+            dropclient(p, DROP_INTERNAL);
+            return;
+        }
+        iov[0].iov_base = &p->buf[at];
+        iov[0].iov_len = room < BUF_SIZE - at ? room : BUF_SIZE - at;
+        iov[1].iov_base = p->buf;
+        iov[1].iov_len = room - iov[0].iov_len;
+        nbytes = readv(p->fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        STAT_ADD(read_calls, 1);
+        if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            inbuf_release(p);
+            return; // drained
+        }
+        if (nbytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes < 0) {
+            dropclient(p, DROP_READ_ERROR);
+            return;
+        }
+        if (nbytes == 0) {
+            dropclient(p, DROP_PEER_CLOSED);
+            return;
+        }
+        STAT_ADD(bytes_read, nbytes);
+        rate_charge(p, RATE_BYTES, nbytes);
+        p->intail += nbytes;
+        p->last_input = wheel_now;
+        if (process_input(p) == false) {
+            return;
+        }
+    }
+}
+
+/* Handle whatever complete input p has buffered. Returns false if p was
+ * dropped.
+ */
+static bool process_input(struct client *p) {
+    int result;
+    // the opponent dropping doesn't stop p, so carry on with p's input
+    while ((result = handle_player(&head, p)) == -2) {
+        if (p->opponent != NULL) {
+            dropclient(p->opponent, DROP_INTERNAL);
+        }
+    }
+    if (result == -1) { // player drops
+        dropclient(p, DROP_INTERNAL);
+        return false;
+    }
+    inbuf_release(p);
+    if (rate_exceeded(p) == true) {
+        return throttle(p);
+    }
+    return true;
+}
+
+/* Give p an input buffer if it has none; p only has one while input is
+ * pending. Returns false if memory runs out.
+ */
+static bool inbuf_attach(struct client *p) {
+    if (p->buf == NULL && (p->buf = pool_get(&inbuf_pool)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+    return true;
+}
+
+/* give p's input buffer back once everything in it has been handled */
+static void inbuf_release(struct client *p) {
+    if (p->buf != NULL && p->inhead == p->intail) {
+        pool_put(&inbuf_pool, p->buf);
+        p->buf = NULL;
+    }
+}
+
+/* the most one of p's buckets holds, in units of 1/TICKS_PER_SEC */
+static long rate_capacity(enum rate_kind kind) {
+    long cap = rate_limits[kind] * RATE_BURST_SECS * TICKS_PER_SEC;
+    return cap < INT32_MAX / 2 ? cap : INT32_MAX / 2;
+}
+
+/* start p off with full buckets */
+static void rate_fill(struct client *p) {
+    int i;
+    for (i = 0; i < NRATES; i++) {
+        p->tokens[i] = rate_capacity(i);
+    }
+    p->refilled = wheel_now;
+    p->throttled_until = 0;
+    p->strikes = 0;
+}
+
+/* top p's buckets up for the ticks since they last were */
+static void rate_refill(struct client *p) {
+    uint32_t elapsed = (uint32_t)wheel_now - p->refilled;
+    int i;
+    
+    if (elapsed == 0) {
+        return;
+    }
+    p->refilled = wheel_now;
+    for (i = 0; i < NRATES; i++) {
+        long cap = rate_capacity(i);
+        long tokens = p->tokens[i] + rate_limits[i] * (long)elapsed;
+        p->tokens[i] = tokens < cap ? tokens : cap;
+    }
+}
+
+/* Take n units of kind from p's bucket. The bucket may go below empty;
+ * process_input() pauses p until it is paid back.
+ */
+static void rate_charge(struct client *p, enum rate_kind kind, int n) {
+    if (rate_limits[kind] == 0) {
+        return;
+    }
+    rate_refill(p);
+    p->tokens[kind] -= n * TICKS_PER_SEC;
+}
+
+/* true if p owes any of its buckets false otherwise */
+static bool rate_exceeded(struct client *p) {
+    int i;
+    for (i = 0; i < NRATES; i++) {
+        if (p->tokens[i] < 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* ticks until every one of p's buckets is out of debt again */
+static uint64_t rate_wait(struct client *p) {
+    uint64_t ticks = 1;
+    int i;
+    for (i = 0; i < NRATES; i++) {
+        if (p->tokens[i] < 0 && rate_limits[i] > 0) {
+            uint64_t need = (-(long)p->tokens[i] + rate_limits[i] - 1) / rate_limits[i];
+            if (need > ticks) {
+                ticks = need;
+            }
+        }
+    }
+    return ticks;
+}
+
+/* p sent more than its buckets allow: stop reading from it until the debt
+ * is paid off, so its input waits in the kernel rather than costing us
+ * reads. Returns false if p was dropped instead, for flooding us with
+ * bytes pause after pause, or with a whole burst more than it may send
+ * before the pause took (a ring's receives may already be queued).
+ */
+static bool throttle(struct client *p) {
+    if (p->tokens[RATE_BYTES] < -rate_capacity(RATE_BYTES)) {
+        dropclient(p, DROP_FLOOD);
+        return false;
+    }
+    if (p->if_throttled == true) {
+        return true;
+    }
+    STAT_ADD(throttles, 1);
+    // a player over its line or chat rate only has to wait
+    if (p->tokens[RATE_BYTES] < 0) {
+        if ((uint32_t)wheel_now - p->throttled_until > THROTTLE_FORGIVE * TICKS_PER_SEC) {
+            p->strikes = 0;
+        }
+        if (++p->strikes >= THROTTLE_STRIKES) {
+            dropclient(p, DROP_FLOOD);
+            return false;
+        }
+    }
+    p->if_throttled = true;
+    watch_input(p, false);
+    timer_arm(&p->throttle_timer, rate_wait(p));
+    return true;
+}
+
+/* Pause (on is false) or resume reading from p: its socket leaves or
+ * rejoins EPOLLIN, or its multishot recv is cancelled or armed again. What
+ * a recv still delivers before its cancellation lands is handled as usual.
+ */
+static void watch_input(struct client *p, bool on) {
+    struct epoll_event ev;
+    
+    if (ring.fd >= 0) {
+        if (on == true && p->if_receiving == false) {
+            uring_recv(p);
+        } else if (on == false && p->if_receiving == true) {
+            struct io_uring_sqe *sqe = uring_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = RING_DATA(RING_RECV, (uint64_t)p->fd << 32 | (uint32_t)p->id);
+            sqe->user_data = RING_DATA(RING_CANCEL, 0);
+        }
+        return;
+    }
+    // re-adding EPOLLIN reports input that arrived during the pause
+    ev.events = (on == true ? EPOLLIN | EPOLLRDHUP : 0) | EPOLLOUT | EPOLLET;
+    ev.data.fd = p->fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, p->fd, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+}
+
+/* Set p's name to the len bytes at name; len < NAME_SIZE. A name too long
+ * for short_name gets a block from the name pool. Returns -1 if memory
+ * runs out.
+ */
+static int set_name(struct client *p, const char *name, int len) {
+    if (len >= NAME_SHORT && p->name == p->short_name) {
+        char *block = pool_get(&name_pool);
+        if (block == NULL) {
+            perror("malloc");
             return -1;
         }
-        
-        // print to p's opponent
-        sprintf(outbuf, "%s takes a break to tell you:\n%s\n\n", p->name, p->buf);
-        if (write(p->opponent->fd, outbuf, strlen(outbuf)) == -1) {
-            return -2;
+        p->name = block;
+    }
+    memcpy(p->name, name, len);
+    p->name[len] = '\0';
+    p->namelen = len;
+    return 0;
+}
+
+/* Copy len bytes received on the ring into p's input buffer, handling it
+ * whenever it fills. A moving player's input is only buffered, for its new
+ * shard to handle; whatever doesn't fit is lost. Returns false if p was
+ * dropped.
+ */
+static bool take_input(struct client *p, const char *data, int len) {
+    STAT_ADD(bytes_read, len);
+    rate_charge(p, RATE_BYTES, len);
+    p->last_input = wheel_now;
+    while (len > 0) {
+        unsigned int at = p->intail & (BUF_SIZE - 1);
+        unsigned int room = BUF_SIZE - (p->intail - p->inhead);
+        unsigned int n = (unsigned int)len < room ? (unsigned int)len : room;
+        unsigned int first = n < BUF_SIZE - at ? n : BUF_SIZE - at;
+        if (n == 0) {
+            return true;
+        }
+        if (inbuf_attach(p) == false) {
+            dropclient(p, DROP_INTERNAL);
+            return false;
+        }
+        memcpy(&p->buf[at], data, first);
+        memcpy(p->buf, data + first, n - first);
+        p->intail += n;
+        data += n;
+        len -= n;
+        if (p->move_to == NULL && process_input(p) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* find the client reading from fd, or NULL if fd is not a client */
+static struct client *lookupclient(int fd) {
+    if (fd < 0 || fd >= maxclients) {
+        return NULL;
+    }
+    return clients[fd];
+}
+
+/* remove the client from the game, close its connection and give its
+ * memory back to the pool. p must not be used afterwards.
+ */
+static void dropclient(struct client *p, enum drop_reason why) {
+    int tmp_fd = p->fd;
+    if (tmp_fd < 0) { // already dropped
+        return;
+    }
+    STAT_ADD(disconnects[why], 1);
+    STAT_ADD(clients, -1);
+    head = removeclient(&head, p);
+    dirty_remove(p);
+    free_output(p);
+    p->fd = -1;
+    if (ring.fd >= 0) {
+        // requests on the ring hold the socket open; this ends them
+        shutdown(tmp_fd, SHUT_RDWR);
+    }
+    close(tmp_fd); // closing the fd also removes it from epfd
+    if (p->buf != NULL) {
+        pool_put(&inbuf_pool, p->buf);
+    }
+    if (p->name != p->short_name) {
+        pool_put(&name_pool, p->name);
+    }
+    pool_put(&client_pool, p);
+}
+
+/* Call an appropriate fucnction depending on the player's input. Keeps
+ * going while the buffered input makes progress, so pipelined lines are
+ * all handled; returns 0 once the rest needs more bytes from the socket.
+ */
+int handle_player(struct client **head, struct client *p) {
+    uint64_t start = now_ns(); // each line's trace span starts where the last ended
+    
+    while (p->inhead != p->intail) {
+        unsigned int before = p->inhead;
+        int result = 0;
+        
+        // a binary client says so with its very first byte
+        if (p->if_name == false && p->if_binary == false && p->inhead == 0
+            && (unsigned char)p->buf[0] == BIN_MAGIC) {
+            char version = BIN_VERSION;
+            if (p->intail < 2) {
+                break; // wait for the version byte
+            }
+            consume_input(p, 2);
+            p->if_binary = true;
+            result = queue_frame(p, BIN_HELLO, &version, 1);
+        }
+        
+        else if (p->if_binary == true) {
+            result = handle_frame(head, p);
+        }
+        
+        // drop what is left of a line that didn't fit in the buffer
+        else if (p->if_discarding == true) {
+            int where = find_network_newline(p);
+            if (where >= 0) {
+                consume_input(p, where + 1);
+                p->if_discarding = false;
+            } else {
+                consume_input(p, p->intail - p->inhead);
+            }
+        }
+        
+        // add a name of the player
+        else if (p->if_name == false && p->if_observing == false) {
+            result = add_name(*head, p);
+        }
+        
+        // a player between matches may watch one
+        else if (p->in_match == false) {
+            result = lobby_command(head, p);
+        }
+        
+        // clears buffer when inactive player inputs something
+        else if (p->if_active == false) {
+            consume_input(p, p->intail - p->inhead);
+        }
+        
+        // get a command from an active player and process it
+        else if (p->if_active == true && p->command == '\0') {
+            result = get_command(head, p);
+        }
+        
+        // handle speak
+        else if (p->if_active == true && p->command == 's') {
+            result = speak(p);
+        }
+        
+        uint64_t end = now_ns();
+        trace_record(TRACE_INPUT, start, end, p->id);
+        start = end;
+        if (result != 0) {
+            return result;
+        }
+        if (p->inhead == before) { // waiting for the rest of a line or frame
+            break;
+        }
+        rate_charge(p, RATE_COMMANDS, 1);
+    }
+    return 0;
+}
+
+/* respond to active player's action */
+int handle_command(struct client **head, struct client *p) {
+    struct battle_event ev;
+    int result;
+    
+    battle_move(&p->match->battle, p->command == 'p', &ev);
+    if ((result = print_damage(p, ev.powermove, ev.damage)) != 0) {
+        return result;
+    }
+    
+    // when p beats the opponent
+    if (ev.over == true) {
+        return end_match(head, p);
+    }
+    see_status(p->match);
+    
+    // print status on player's side
+    if (print_status(p) == -1 || print_inactive_player(p) == -1) {
+        return -1;
+    }
+    // print status on opponent's side
+    if (print_status(p->opponent) == -1 || print_active_player(p->opponent) == -1) {
+        return -2;
+    }
+    
+    // flip the side
+    p->command = '\0'; // initialize command for the next action
+    p->if_active = false;
+    p->opponent->if_active = true;
+    timer_cancel(&p->turn_timer);
+    if (turn_ticks > 0) {
+        timer_arm(&p->opponent->turn_timer, turn_ticks);
+    }
+    
+    return 0;
+}
+
+/* read the player's input till find a valid command and return it
+ * return -1 if fails
+ */
+char get_command(struct client **head, struct client *p) {
+    int where; // location of a valid command
+
+    where = find_valid_command(p);
+    
+    if (where < 0) { // nothing but noise so far, and it will stay noise
+        consume_input(p, p->intail - p->inhead);
+        return 0;
+    }
+    else { // have a command
+        p->command = p->buf[(p->inhead + where) & (BUF_SIZE - 1)];
+        consume_input(p, where + 1);
+        // the rest of the command's line, if it is here already, goes too
+        int eol = find_network_newline(p);
+        if (eol >= 0) {
+            consume_input(p, eol + 1);
+        }
+        if (p->command != 's') {
+            return take_turn(head, p);
+        }
+        else if (p->command == 's') {
+            // print to p
+            return QUEUE_LITERAL(p, "\nSpeak: \n");
+        }
+    }
+    return 0;
+}
+
+/* play p's attack or powermove, timing it for the metrics */
+static int take_turn(struct client **head, struct client *p) {
+    uint64_t start = now_ns();
+    int result = handle_command(head, p);
+    uint64_t end = now_ns();
+    uint64_t took = end - start;
+    trace_record(TRACE_TURN, start, end, p->id);
+    STAT_ADD(turns, 1);
+    observe(self->stats.turn_hist, turn_bounds, NTURN_BUCKETS, took);
+    STAT_ADD(turn_count, 1);
+    STAT_ADD(turn_sum_ns, took);
+    return result;
+}
+
+/* find the position of 'a', 's' or 'p' in the player's input*/
+int find_valid_command(struct client *p) {
+    unsigned int i = 0;
+    while (i < p->intail - p->inhead) {
+        char c = p->buf[(p->inhead + i) & (BUF_SIZE - 1)];
+        if (c == 'a' || c == 's' || (c == 'p' && p->match->battle.powermoves[fighter(p)] != 0)) {
+            return i;
+        }
+        i++;
+    }
+    return -1;
+}
+
+/* notifies the players of the end of this match and rearrange the list */
+int end_match(struct client **head, struct client *p) {
+    struct client *opponent = p->opponent;
+    char won = BIN_END_WON, lost = BIN_END_LOST;
+    char *at;
+    // notifies to p
+    if (p->if_binary == true) {
+        if (queue_frame(p, BIN_END, &won, 1) == -1) {
+            return -1;
+        }
+    } else {
+        if ((at = out_begin(p, MSG_SIZE)) == NULL) {
+            return -1;
+        }
+        at = put_name(at, opponent);
+        at = PUT(at, " gives up. You win!\n\n");
+        out_end(p, at);
+    }
+    // notifies to opponent
+    if (opponent->if_binary == true) {
+        if (queue_frame(opponent, BIN_END, &lost, 1) == -1) {
+            return -2;
+        }
+    } else {
+        if ((at = out_begin(opponent, MSG_SIZE)) == NULL) {
+            return -2;
+        }
+        at = PUT(at, "You are no match for ");
+        at = put_name(at, p);
+        at = PUT(at, ". You scurry away...\n\n");
+        out_end(opponent, at);
+    }
+    see_result(p, opponent, false);
+    record_result(p, opponent);
+    
+    // update their status
+    end_of_match(p, p->opponent);
+    
+    // find new opponents
+    if (print_waiting(p) == -1) {
+        return -1;
+    }
+    if (print_waiting(p->opponent) == -1) {
+        return -2;
+    }
+    
+    // the match is over, so neither of them is paired any more
+    p->opponent = NULL;
+    opponent->opponent = NULL;
+	find_opponent(*head, opponent);
+    find_opponent(*head, p);
+    
+    return 0;
+}
+
+/* handle when the player selects (s)peak */
+int speak(struct client *p) {
+    char message[BUF_SIZE];
+    int len = next_line(p, message, sizeof(message));
+    
+    if (len >= 0) { // have complete message
+        return say(p, message, len);
+    }
+
+    return 0;
+}
+
+/* Pass p's message on to its opponent and give p its turn back. Chat is
+ * the first thing a backlogged player (see out_backlogged()) goes without.
+ */
+static int say(struct client *p, const char *message, int len) {
+    char *at;
+    
+    rate_charge(p, RATE_CHAT, 1);
+    // print to p
+    if (out_backlogged(p) == true) {
+        STAT_ADD(output_skips, 1);
+    } else if (p->if_binary == true) {
+        if (queue_chat(p, 1, message, len) == -1) {
+            return -1;
+        }
+    } else {
+        if ((at = out_begin(p, BUF_SIZE + 16)) == NULL) {
+            return -1;
+        }
+        at = PUT(at, "You speak: ");
+        at = put_bytes(at, message, len);
+        at = PUT(at, "\n");
+        out_end(p, at);
+    }
+    
+    // print to p's opponent
+    if (out_backlogged(p->opponent) == true) {
+        STAT_ADD(output_skips, 1);
+    } else if (p->opponent->if_binary == true) {
+        if (queue_chat(p->opponent, 0, message, len) == -1) {
+            return -2;
+        }
+    } else {
+        if ((at = out_begin(p->opponent, MSG_SIZE + BUF_SIZE)) == NULL) {
+            return -2;
+        }
+        at = put_name(at, p);
+        at = PUT(at, " takes a break to tell you:\n");
+        at = put_bytes(at, message, len);
+        at = PUT(at, "\n\n");
+        out_end(p->opponent, at);
+    }
+    see_chat(p, message, len);
+
+    // print status on player's side
+    if (print_status(p) == -1 || print_active_player(p) == -1) {
+        return -1;
+    }
+    // print status on opponent's side
+    if (print_status(p->opponent) == -1 || print_inactive_player(p->opponent) == -1) {
+        return -2;
+    }
+
+    p->command = '\0'; // initialize command for the next action
+    return 0;
+}
+
+/* Find an opponent for p. Waiting players are tried oldest first (with -r,
+ * closest rating first); if none of them can fight p, p joins the end of
+ * the waiting queue.
+ */
+int find_opponent(struct client *head, struct client *p) {
+    struct client *current;
+    uint64_t start;
+    int result = 0;
+    
+    if (p->if_name == false || p->in_match == true || p->if_observing == true) {
+        return 0;
+    }
+    wait_remove(p); // p searches from the back of the queue
+    start = now_ns();
+    if (p->wait_since == 0) {
+        p->wait_since = start;
+    }
+    
+    if (rating_mode == true) {
+        current = nearest_opponent(p);
+    } else {
+        current = waithead;
+        while (current != NULL && current->last_opponent == p->id) { // restriction for a new oppoent
+            current = current->wait_next;
+        }
+    }
+    if (current != NULL) {
+        result = engage(head, p, current);
+    }
+    
+    // nobody here can fight p: try a shard that has players waiting. With -r
+    // p stays while anybody waits here, as their windows keep widening
+    else if ((rating_mode == true && waithead != NULL) || handoff(p) == false) {
+        wait_push(p);
+        if (waithead == p) {
+            rebalance(); // let busier shards send a waiting player down to us
+        }
+    }
+    trace_record(TRACE_MATCHMAKING, start, now_ns(), p->id);
+    return result;
+}
+
+/* Pair p with opponent, who is waiting, and start their match. p moves
+ * first. If there is no memory for the match nothing changes: p goes back
+ * to the waiting queue and looks again in a second. Returns -1 if p should
+ * be dropped, -2 if opponent should.
+ */
+static int engage(struct client *head, struct client *p, struct client *opponent) {
+    struct match *m = pool_get(&match_pool);
+    if (!m) {
+        perror("malloc");
+        wait_push(p);
+        timer_arm(&p->match_timer, TICKS_PER_SEC);
+        return 0;
+    }
+    wait_remove(opponent);
+    
+    // record how long both of them waited
+    uint64_t now = now_ns();
+    observe(self->stats.wait_hist, wait_bounds, NWAIT_BUCKETS, now - p->wait_since);
+    observe(self->stats.wait_hist, wait_bounds, NWAIT_BUCKETS, now - opponent->wait_since);
+    STAT_ADD(wait_count, 2);
+    STAT_ADD(wait_sum_ns, (now - p->wait_since) + (now - opponent->wait_since));
+    p->wait_since = 0;
+    opponent->wait_since = 0;
+    
+    // update status of p
+    p->opponent = opponent;
+    p->last_opponent = opponent->id;
+    p->if_active = true;
+    p->in_match = true;
+    if (print_engage(p) == -1) {
+        pool_put(&match_pool, m);
+        return -1;
+    }
+    
+    // update status of opponent
+    opponent->opponent = p;
+    opponent->last_opponent = p->id;
+    opponent->if_active = false;
+    opponent->in_match = true;
+    if (print_engage(opponent) == -1) {
+        pool_put(&match_pool, m);
+        return -2;
+    }
+    
+    return start_match(head, p, opponent, m);
+}
+
+/* Find the waiting player closest to p's rating that p may fight, within
+ * p's window: RATING_WINDOW points, and RATING_WIDEN more for every second
+ * p has waited; the one waiting longest among equals. Occupied buckets are
+ * visited nearest first, so the first player found is the answer, and
+ * only players p may not fight are ever passed over. Returns NULL if there
+ * is nobody.
+ */
+static struct client *nearest_opponent(struct client *p) {
+    uint64_t waited = (now_ns() - p->wait_since) / 1000000000ULL;
+    int reach = RATING_WINDOW + (waited > 4096 ? 4096 : (int)waited) * RATING_WIDEN;
+    int b = rating_bucket(p->rating);
+    int up = bucket_above(b), down = bucket_below(b - 1);
+    struct client *q = bucket_opponent(p, b, reach);
+    
+    while (q == NULL && (up != -1 || down != -1)) {
+        // how far p is from the next bucket each way
+        int up_gap = up == -1 ? INT_MAX : up - p->rating;
+        int down_gap = down == -1 ? INT_MAX : p->rating - down;
+        if (up_gap > reach) {
+            up = -1;
+        }
+        if (down_gap > reach) {
+            down = -1;
+        }
+        if (up != -1 && (down == -1 || up_gap <= down_gap)) {
+            q = bucket_opponent(p, up, reach);
+            up = bucket_above(up);
+        } else if (down != -1) {
+            q = bucket_opponent(p, down, reach);
+            down = bucket_below(down - 1);
+        }
+    }
+    return q;
+}
+
+/* the player waiting longest in bucket b that p may fight, if it is no
+ * more than reach points away; NULL if there is none
+ */
+static struct client *bucket_opponent(struct client *p, int b, int reach) {
+    struct client *q;
+    int gap;
+    
+    for (q = bucket_head[b]; q != NULL; q = q->rate_next) {
+        gap = q->rating > p->rating ? q->rating - p->rating : p->rating - q->rating;
+        if (q != p && q->last_opponent != p->id && gap <= reach) {
+            return q;
+        }
+    }
+    return NULL;
+}
+
+/* the index bucket a rating falls in */
+static int rating_bucket(int rating) {
+    if (rating < 0) {
+        return 0;
+    }
+    if (rating >= RATING_BUCKETS) {
+        return RATING_BUCKETS - 1;
+    }
+    return rating;
+}
+
+/* the first bucket after b with anybody in it, -1 if none */
+static int bucket_above(int b) {
+    int word, bit = b + 1;
+    uint64_t bits;
+    
+    if (bit >= RATING_BUCKETS) {
+        return -1;
+    }
+    word = bit / 64;
+    bits = bucket_bits[word] & (~0ULL << (bit % 64));
+    while (bits == 0) {
+        if (++word == RATING_BUCKETS / 64) {
+            return -1;
+        }
+        bits = bucket_bits[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+/* the last bucket up to and including b with anybody in it, -1 if none */
+static int bucket_below(int b) {
+    int word;
+    uint64_t bits;
+    
+    if (b < 0) {
+        return -1;
+    }
+    word = b / 64;
+    bits = bucket_bits[word] & (~0ULL >> (63 - b % 64));
+    while (bits == 0) {
+        if (--word < 0) {
+            return -1;
+        }
+        bits = bucket_bits[word];
+    }
+    return word * 64 + 63 - __builtin_clzll(bits);
+}
+
+/* add a waiting player to the end of its rating bucket */
+static void rating_add(struct client *p) {
+    int b = rating_bucket(p->rating);
+    p->rate_next = NULL;
+    p->rate_prev = bucket_tail[b];
+    if (bucket_tail[b] == NULL) {
+        bucket_head[b] = p;
+        bucket_bits[b / 64] |= 1ULL << (b % 64);
+    } else {
+        bucket_tail[b]->rate_next = p;
+    }
+    bucket_tail[b] = p;
+}
+
+/* take a waiting player out of its rating bucket */
+static void rating_remove(struct client *p) {
+    int b = rating_bucket(p->rating);
+    if (p->rate_prev == NULL) {
+        bucket_head[b] = p->rate_next;
+    } else {
+        p->rate_prev->rate_next = p->rate_next;
+    }
+    if (p->rate_next == NULL) {
+        bucket_tail[b] = p->rate_prev;
+    } else {
+        p->rate_next->rate_prev = p->rate_prev;
+    }
+    if (bucket_head[b] == NULL) {
+        bucket_bits[b / 64] &= ~(1ULL << (b % 64));
+    }
+    p->rate_next = NULL;
+    p->rate_prev = NULL;
+}
+
+/* add p to the end of the waiting queue */
+static void wait_push(struct client *p) {
+    queue_link(&waithead, &waittail, p);
+    p->if_waiting = true;
+    if (rating_mode == true) {
+        rating_add(p);
+        timer_arm(&p->match_timer, TICKS_PER_SEC); // look again once the window has widened
+    }
+    atomic_fetch_add_explicit(&self->nwaiting, 1, memory_order_relaxed);
+}
+
+/* take p out of the waiting queue (or the leaving list) if it is in it */
+static void wait_remove(struct client *p) {
+    if (p->if_waiting == true) {
+        queue_unlink(&waithead, &waittail, p);
+        p->if_waiting = false;
+        if (rating_mode == true) {
+            rating_remove(p);
+        }
+        timer_cancel(&p->match_timer);
+        atomic_fetch_sub_explicit(&self->nwaiting, 1, memory_order_relaxed);
+    }
+    else if (p->if_leaving == true) {
+        queue_unlink(&leavehead, &leavetail, p);
+        p->if_leaving = false;
+    }
+}
+
+/* append p to a queue linked through wait_next/wait_prev */
+static void queue_link(struct client **qhead, struct client **qtail, struct client *p) {
+    p->wait_next = NULL;
+    p->wait_prev = *qtail;
+    if (*qtail == NULL) {
+        *qhead = p;
+    } else {
+        (*qtail)->wait_next = p;
+    }
+    *qtail = p;
+}
+
+/* take p out of a queue linked through wait_next/wait_prev */
+static void queue_unlink(struct client **qhead, struct client **qtail, struct client *p) {
+    if (p->wait_prev == NULL) {
+        *qhead = p->wait_next;
+    } else {
+        p->wait_prev->wait_next = p->wait_next;
+    }
+    if (p->wait_next == NULL) {
+        *qtail = p->wait_prev;
+    } else {
+        p->wait_next->wait_prev = p->wait_prev;
+    }
+    p->wait_next = NULL;
+    p->wait_prev = NULL;
+}
+
+/* Find a lower-numbered shard with players waiting. Players only ever move
+ * down, so two lonely players can never keep swapping shards.
+ */
+static struct shard *waiting_shard(void) {
+    int i;
+    for (i = 0; i < self->index; i++) {
+        if (atomic_load_explicit(&shards[i].nwaiting, memory_order_relaxed) > 0) {
+            return &shards[i];
+        }
+    }
+    return NULL;
+}
+
+/* Mark waiting player p to move to a shard where someone is waiting.
+ * p stays ours until send_leaving() runs at the end of the iteration.
+ * Returns false if no shard has anyone waiting.
+ */
+static bool handoff(struct client *p) {
+    if (waiting_shard() == NULL) {
+        return false;
+    }
+    queue_link(&leavehead, &leavetail, p);
+    p->if_leaving = true;
+    return true;
+}
+
+/* detach every leaving player from this shard and post it to its new one */
+static void send_leaving(void) {
+    while (leavehead != NULL) {
+        struct client *p = leavehead;
+        struct shard *to;
+        wait_remove(p);
+        
+        // the shard may have stopped waiting in the meantime
+        if ((to = waiting_shard()) == NULL) {
+            wait_push(p);
+            continue;
+        }
+        // the new shard starts with an empty socket buffer to wait on
+        if (flushclient(p) == -1) {
+            dropclient(p, DROP_WRITE_ERROR);
+            continue;
+        }
+        // requests still in flight on our ring would complete here, so
+        // cancel them and finish the move once they have (see uring_move())
+        if (ring.fd >= 0 && (p->if_receiving == true || p->if_blocked == true)) {
+            p->move_to = to;
+            uring_cancel(p);
+            continue;
+        }
+        move_client(p, to);
+    }
+}
+
+/* detach p from this shard and post it to shard to */
+static void move_client(struct client *p, struct shard *to) {
+    // matches stay on their shard, so a spectator stops watching
+    if (p->watching != NULL) {
+        stop_watching(p);
+        if (p->if_binary == true) {
+            queue_frame(p, BIN_SPECTATE, NULL, 0);
+        } else {
+            QUEUE_LITERAL(p, "You stop watching.\n");
+        }
+    }
+    STAT_ADD(clients, -1);
+    STAT_ADD(output_bytes, -p->outbytes); // the output goes with p
+    dirty_remove(p);
+    if (ring.fd < 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    }
+    clients[p->fd] = NULL;
+    list_unlink(&head, p);
+    timer_cancel(&p->idle_timer); // timers belong to this shard's wheel
+    timer_cancel(&p->throttle_timer);
+    p->if_throttled = false; // the new shard reads it again; the debt goes along
+    p->opponent = NULL; // the old pairing stays behind on this shard
+    p->if_blocked = false;
+    post(to, MSG_CLIENT, p, NULL, NULL);
+}
+
+/* take over a waiting player handed off by another shard */
+static void adoptclient(struct client *p) {
+    setclient(p->fd, p);
+    list_append(&head, p);
+    STAT_ADD(clients, 1);
+    STAT_ADD(output_bytes, p->outbytes);
+    if (watchclient(p) == false) {
+        dropclient(p, DROP_INTERNAL);
+        return;
+    }
+    if (p->outhead != NULL) {
+        dirty_push(p);
+    }
+    if (idle_ticks > 0) {
+        timer_arm(&p->idle_timer, idle_ticks); // rechecked against last_input
+    }
+    find_opponent(head, p);
+    // input the old shard's ring received while p was moving
+    if (p->inhead != p->intail) {
+        process_input(p);
+    }
+}
+
+/* Our waiting queue just became non-empty: ask the higher-numbered shards
+ * that have players waiting to hand one of them down to us.
+ */
+static void rebalance(void) {
+    int i;
+    for (i = self->index + 1; i < nshards; i++) {
+        if (atomic_load_explicit(&shards[i].nwaiting, memory_order_relaxed) > 0) {
+            post(&shards[i], MSG_REBALANCE, NULL, NULL, NULL);
+        }
+    }
+}
+
+/* push a message onto another shard's inbox and wake it up */
+static void post(struct shard *to, enum shard_msg_type type, struct client *p,
+                 struct outbuf *b, struct outbuf *bin) {
+    struct shard_msg *m = malloc(sizeof(struct shard_msg));
+    uint64_t one = 1;
+    if (m == NULL) {
+        perror("malloc");
+        return;
+    }
+    m->type = type;
+    m->p = p;
+    m->b = b;
+    m->bin = bin;
+    m->next = atomic_load_explicit(&to->inbox, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&to->inbox, &m->next, m,
+                                                  memory_order_release, memory_order_relaxed)) {
+        // m->next now holds the current top; try again
+    }
+    if (write(to->wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+/* handle every message other shards have posted to us */
+static void read_inbox(void) {
+    uint64_t count;
+    struct shard_msg *m, *rev = NULL;
+    
+    if (read(self->wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+    // take the whole stack at once and reverse it into arrival order
+    m = atomic_exchange_explicit(&self->inbox, NULL, memory_order_acquire);
+    while (m != NULL) {
+        struct shard_msg *next = m->next;
+        m->next = rev;
+        rev = m;
+        m = next;
+    }
+    
+    while (rev != NULL) {
+        m = rev;
+        rev = m->next;
+        if (m->type == MSG_CLIENT) {
+            adoptclient(m->p);
+        }
+        else if (m->type == MSG_BROADCAST) {
+            struct client *p;
+            for (p = head; p; p = p->next) {
+                if (out_backlogged(p) == true) {
+                    STAT_ADD(output_skips, 1);
+                } else {
+                    queue_shared(p, p->if_binary ? m->bin : m->b);
+                }
+            }
+            outbuf_release(m->b);
+            outbuf_release(m->bin);
+        }
+        else if (m->type == MSG_REBALANCE && waithead != NULL) {
+            struct client *p = waithead;
+            wait_remove(p);
+            if (handoff(p) == false) {
+                wait_push(p);
+            }
+        }
+        else if (m->type == MSG_FREEZE) {
+            freezing = true; // see freeze(), at the end of this iteration
+        }
+        else if (m->type == MSG_RESTORE) {
+            restoreclient(m->p);
+        }
+        free(m);
+    }
+}
+
+/* set up a new match in m */
+int start_match(struct client *head, struct client *player, struct client *opponent, struct match *m) {
+    // seed the match's own generator once, and roll the fighters' hitpoints/powermoves
+    m->seed = splitmix64(&seed_state);
+    battle_start(&m->battle, m->seed);
+    m->fighters[0] = player;
+    m->fighters[1] = opponent;
+    m->viewers = NULL;
+    m->seen = NULL;
+    m->seen_bin = NULL;
+    m->seen_next = NULL;
+    m->if_seen = false;
+    m->if_over = false;
+    player->match = m;
+    opponent->match = m;
+    // fighters don't watch
+    stop_watching(player);
+    stop_watching(opponent);
+    STAT_ADD(matches, 1);
+    if (verbose) {
+        printf("match %s vs %s seed %#llx\n", player->name, opponent->name,
+               (unsigned long long)m->seed);
+    }
+    
+    player->command = '\0';
+    opponent->command = '\0';
+    if (turn_ticks > 0) {
+        timer_arm(&player->turn_timer, turn_ticks); // player moves first
+    }
+    
+    // print on player's side
+    if (print_status(player) == -1 || print_active_player(player) == -1) {
+        return -1;
+    }
+    
+    // print on opponent's side
+    if (print_status(opponent) == -1 || print_inactive_player(opponent) == -1) {
+        return -2;
+    }
+    
+    return 0;
+}
+
+/* take both players out of their match and release its state */
+static void end_of_match(struct client *a, struct client *b) {
+    struct match *m = a->match;
+    if (m != NULL) {
+        STAT_ADD(matches, -1);
+        if (m->viewers != NULL || m->if_seen == true) {
+            // fan_out() frees it once the spectators have the last events
+            m->if_over = true;
+            see_push(m);
+        } else {
+            pool_put(&match_pool, m);
+        }
+    }
+    a->in_match = false;
+    b->in_match = false;
+    timer_cancel(&a->turn_timer);
+    timer_cancel(&b->turn_timer);
+    a->match = NULL;
+    b->match = NULL;
+}
+
+/* step a splitmix64 sequence; used to turn one seed into many */
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* seed a generator; the same seed always gives the same rolls */
+static void rng_seed(struct rng *r, uint64_t seed) {
+    int i;
+    for (i = 0; i < 4; i++) {
+        r->s[i] = splitmix64(&seed);
+    }
+}
+
+/* next 64 random bits (xoshiro256**) */
+static uint64_t rng_next(struct rng *r) {
+    uint64_t *s = r->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+/* uniform integer in [lo, hi] */
+static int rng_range(struct rng *r, int lo, int hi) {
+    uint64_t span = (uint64_t)(hi - lo + 1);
+    return lo + (int)(((rng_next(r) >> 32) * span) >> 32);
+}
+
+/* Seed a battle's generator and roll both fighters' hitpoints and
+ * powermoves. The same seed always gives the same battle.
+ */
+static void battle_start(struct battle *b, uint64_t seed) {
+    int i;
+    rng_seed(&b->rng, seed);
+    for (i = 0; i < 2; i++) {
+        b->hitpoints[i] = rng_range(&b->rng, 20, 30);
+        b->powermoves[i] = rng_range(&b->rng, 1, 3);
+        b->start_hp[i] = b->hitpoints[i];
+    }
+    b->turn = 0;
+    b->winner = -1;
+}
+
+/* Play the move of the fighter whose turn it is and say what it did in ev.
+ * An attack does 2-6 damage; a powermove does three times as much, but
+ * only hits half the time. A powermove with none left is played as an
+ * attack. The turn passes to the other fighter unless this move won.
+ */
+static void battle_move(struct battle *b, bool powermove, struct battle_event *ev) {
+    int me = b->turn;
+    int damage = rng_range(&b->rng, 2, 6); // randomly pick attack
+    
+    ev->attacker = me;
+    ev->powermove = powermove == true && b->powermoves[me] > 0;
+    if (ev->powermove == true) {
+        b->powermoves[me]--;
+        if (rng_range(&b->rng, 0, 1) == 1) { // randomly decide if the powermove hits
+            damage = damage * 3;
+        } else {
+            damage = 0;
+        }
+    }
+    b->hitpoints[1 - me] -= damage;
+    ev->damage = damage;
+    ev->over = b->hitpoints[1 - me] <= 0;
+    if (ev->over == true) {
+        b->winner = me;
+    } else {
+        b->turn = 1 - me;
+    }
+}
+
+/* Play matches battles on nshards threads and report how they went. Each
+ * thread draws its seeds like a shard does, so -s makes the run repeatable.
+ */
+static void simulate(long matches) {
+    struct sim_job *jobs = calloc(nshards, sizeof(struct sim_job));
+    struct sim_job total;
+    uint64_t start, took;
+    int i;
+    
+    if (jobs == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    start = now_ns();
+    for (i = 0; i < nshards; i++) {
+        jobs[i].matches = matches / nshards + (i < matches % nshards);
+        if (fixed_seed == true) {
+            jobs[i].seed_state = base_seed + i * 0x9e3779b97f4a7c15ULL;
+        } else if (getrandom(&jobs[i].seed_state, sizeof(jobs[i].seed_state), 0)
+                   != sizeof(jobs[i].seed_state)) {
+            jobs[i].seed_state = time(NULL) ^ ((uint64_t)i << 32);
+        }
+        if (pthread_create(&jobs[i].thread, NULL, run_sim, &jobs[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nshards; i++) {
+        pthread_join(jobs[i].thread, NULL);
+        total.matches += jobs[i].matches;
+        total.first_wins += jobs[i].first_wins;
+        total.turns += jobs[i].turns;
+        total.powermoves += jobs[i].powermoves;
+        total.powermove_hits += jobs[i].powermove_hits;
+        total.damage += jobs[i].damage;
+    }
+    took = now_ns() - start;
+    
+    printf("%ld matches on %d threads in %.3fs: %.0f matches/s, %.1f ns per turn per thread\n",
+           total.matches, nshards, took / 1e9, total.matches / (took / 1e9),
+           (double)took * nshards / total.turns);
+    printf("the first to move won %.2f%%; %.2f turns and %.2f damage per match\n",
+           100.0 * total.first_wins / total.matches, (double)total.turns / total.matches,
+           (double)total.damage / total.matches);
+    printf("%.2f powermoves per match, %.2f%% of them hit\n",
+           (double)total.powermoves / total.matches,
+           total.powermoves > 0 ? 100.0 * total.powermove_hits / total.powermoves : 0.0);
+    free(jobs);
+}
+
+/* A simulator thread. Both bots play a powermove whenever they have one
+ * left, since on average it does more damage than an attack.
+ */
+static void *run_sim(void *arg) {
+    struct sim_job *job = arg;
+    struct battle b;
+    struct battle_event ev;
+    long i, first_wins = 0, turns = 0, powermoves = 0, hits = 0, damage = 0;
+    
+    for (i = 0; i < job->matches; i++) {
+        battle_start(&b, splitmix64(&job->seed_state));
+        do {
+            battle_move(&b, b.powermoves[b.turn] > 0, &ev);
+            turns++;
+            damage += ev.damage;
+            if (ev.powermove == true) {
+                powermoves++;
+                hits += ev.damage > 0;
+            }
+        } while (ev.over == false);
+        first_wins += b.winner == 0;
+    }
+    job->first_wins = first_wins;
+    job->turns = turns;
+    job->powermoves = powermoves;
+    job->powermove_hits = hits;
+    job->damage = damage;
+    return NULL;
+}
+
+/* tell p and its opponent what p's move did. damage 0 means it missed */
+static int print_damage(struct client *p, bool powermove, int damage) {
+    char frame[2];
+    char *at;
+    
+    // print to the player
+    if (p->if_binary == true) {
+        frame[0] = BIN_DAMAGE_DEALT | (powermove ? BIN_DAMAGE_POWERMOVE : 0);
+        frame[1] = damage;
+        if (queue_frame(p, BIN_DAMAGE, frame, 2) == -1) {
+            return -1;
+        }
+    } else {
+        if ((at = out_begin(p, MSG_SIZE)) == NULL) {
+            return -1;
+        }
+        if (damage == 0) {
+            at = PUT(at, "\nYou missed!\n");
+        } else {
+            at = PUT(at, "\nYou hit ");
+            at = put_name(at, p->opponent);
+            at = PUT(at, " for ");
+            at = put_int(at, damage);
+            at = PUT(at, " damage!\n");
+        }
+        out_end(p, at);
+    }
+    
+    // print to the opponent
+    if (p->opponent->if_binary == true) {
+        frame[0] = powermove ? BIN_DAMAGE_POWERMOVE : 0;
+        frame[1] = damage;
+        if (queue_frame(p->opponent, BIN_DAMAGE, frame, 2) == -1) {
+            return -2;
+        }
+    } else {
+        if ((at = out_begin(p->opponent, MSG_SIZE)) == NULL) {
+            return -2;
+        }
+        at = put_name(at, p);
+        if (damage == 0) {
+            at = PUT(at, " missed you!\n");
+        } else {
+            if (powermove) {
+                at = PUT(at, " powermoves you for ");
+            } else {
+                at = PUT(at, " hits you for ");
+            }
+            at = put_int(at, damage);
+            at = PUT(at, " damage!\n");
+        }
+        out_end(p->opponent, at);
+    }
+    see_damage(p, powermove, damage);
+    return 0;
+}
+
+/* print status on active player's side */
+int print_active_player(struct client *p) {
+    if (p->if_binary == true) {
+        char yours = 1;
+        return queue_frame(p, BIN_TURN, &yours, 1);
+    }
+    if (p->match->battle.powermoves[fighter(p)] != 0) { // option if there is powermove left
+        return QUEUE_LITERAL(p, "(a)ttack\n(p)owermoves\n(s)peak something\n");
+    }
+    return QUEUE_LITERAL(p, "(a)ttack\n(s)peak something\n");
+}
+
+/* print status on inactive player's side */
+int print_inactive_player(struct client *p) {
+    char *at;
+    if (p->if_binary == true) {
+        char yours = 0;
+        return queue_frame(p, BIN_TURN, &yours, 1);
+    }
+    if ((at = out_begin(p, MSG_SIZE)) == NULL) {
+        return -1;
+    }
+    at = PUT(at, "Waiting for ");
+    at = put_name(at, p->opponent);
+    at = PUT(at, " to strike...\n\n");
+    out_end(p, at);
+    return 0;
+}
+
+/* tell p it is waiting for its next opponent */
+static int print_waiting(struct client *p) {
+    if (p->if_binary == true) {
+        return queue_frame(p, BIN_WAITING, NULL, 0);
+    }
+    return QUEUE_LITERAL(p, "Awaiting next opponent...\n");
+}
+
+/* tell p who its new opponent is */
+static int print_engage(struct client *p) {
+    char *at;
+    if (p->if_binary == true) {
+        return queue_frame(p, BIN_MATCH, p->opponent->name, p->opponent->namelen);
+    }
+    if ((at = out_begin(p, MSG_SIZE)) == NULL) {
+        return -1;
+    }
+    at = PUT(at, "You engage ");
+    at = put_name(at, p->opponent);
+    at = PUT(at, "!\n");
+    out_end(p, at);
+    return 0;
+}
+
+/* print the status of the match*/
+int print_status(struct client *p) {
+    struct battle *b = &p->match->battle;
+    int me = fighter(p);
+    char *at;
+    if (p->if_binary == true) {
+        char frame[3] = { b->hitpoints[me], b->powermoves[me], b->hitpoints[1 - me] };
+        return queue_frame(p, BIN_STATUS, frame, 3);
+    }
+    if ((at = out_begin(p, MSG_SIZE)) == NULL) {
+        return -1;
+    }
+    at = PUT(at, "Your hitpoints: ");
+    at = put_int(at, b->hitpoints[me]);
+    at = PUT(at, "\nYour powermoves: ");
+    at = put_int(at, b->powermoves[me]);
+    at = PUT(at, "\n\n");
+    at = put_name(at, p->opponent);
+    at = PUT(at, "'s hitpoints: ");
+    at = put_int(at, b->hitpoints[1 - me]);
+    at = PUT(at, "\n\n");
+    out_end(p, at);
+    return 0;
+}
+
+
+/* Between matches a text player may type "watch [name]", "observe [name]"
+ * or "stop"; anything else is ignored, as before.
+ */
+static int lobby_command(struct client **head, struct client *p) {
+    char line[BUF_SIZE];
+    int len = next_line(p, line, sizeof(line));
+    
+    if (len < 0) {
+        return 0; // wait for the rest of the line
+    }
+    return lobby_line(*head, p, line, len);
+}
+
+/* act on one line typed between matches */
+static int lobby_line(struct client *head, struct client *p, const char *line, int len) {
+    bool observing;
+    int skip;
+    
+    if (len == 4 && memcmp(line, "stop", 4) == 0) {
+        return stop_spectating(head, p);
+    }
+    if (len == 3 && memcmp(line, "top", 3) == 0) {
+        return print_top(p);
+    }
+    if (len >= 5 && memcmp(line, "watch", 5) == 0) {
+        observing = false;
+        skip = 5;
+    } else if (len >= 7 && memcmp(line, "observe", 7) == 0) {
+        observing = true;
+        skip = 7;
+    } else {
+        return 0;
+    }
+    if (skip < len && line[skip] != ' ') {
+        return 0; // "watchful" is not a command
+    }
+    while (skip < len && line[skip] == ' ') {
+        skip++;
+    }
+    return spectate(head, p, &line[skip], len - skip, observing);
+}
+
+/* Make p a spectator of the match the fighter called name (any match if
+ * len is 0) is in on this shard. An observer leaves the waiting queue.
+ */
+static int spectate(struct client *head, struct client *p, const char *name, int len,
+                    bool observing) {
+    struct match *m = find_match(head, name, len);
+    
+    if (m == NULL) {
+        if (p->if_binary == true) {
+            return queue_frame(p, BIN_SPECTATE, NULL, 0);
+        }
+        return QUEUE_LITERAL(p, "There is no such match here.\n");
+    }
+    stop_watching(p);
+    if (observing == true) {
+        wait_remove(p);
+        p->if_observing = true;
+    }
+    p->watching = m;
+    p->view_prev = NULL;
+    p->view_next = m->viewers;
+    if (m->viewers != NULL) {
+        m->viewers->view_prev = p;
+    }
+    m->viewers = p;
+    STAT_ADD(spectators, 1);
+    return print_spectate(p);
+}
+
+/* p stops watching; an observer goes back to the waiting queue */
+static int stop_spectating(struct client *head, struct client *p) {
+    bool observing = p->if_observing;
+    
+    stop_watching(p);
+    p->if_observing = false;
+    if (p->if_binary == true) {
+        if (queue_frame(p, BIN_SPECTATE, NULL, 0) == -1) {
+            return -1;
+        }
+    } else if (QUEUE_LITERAL(p, "You stop watching.\n") == -1) {
+        return -1;
+    }
+    if (observing == true && p->if_name == false) { // time to enter the arena
+        // a binary client joins with BIN_JOIN; only text clients get the prompt
+        return p->if_binary == true ? 0 : QUEUE_LITERAL(p, "What is your name? ");
+    }
+    if (observing == true) {
+        if (print_waiting(p) == -1) {
+            return -1;
+        }
+        return find_opponent(head, p);
+    }
+    return 0;
+}
+
+/* take p out of the audience of the match it watches, if any */
+static void stop_watching(struct client *p) {
+    struct match *m = p->watching;
+    if (m == NULL) {
+        return;
+    }
+    if (p->view_prev == NULL) {
+        m->viewers = p->view_next;
+    } else {
+        p->view_prev->view_next = p->view_next;
+    }
+    if (p->view_next != NULL) {
+        p->view_next->view_prev = p->view_prev;
+    }
+    p->view_next = NULL;
+    p->view_prev = NULL;
+    p->watching = NULL;
+    p->if_lagging = false;
+    STAT_ADD(spectators, -1);
+}
+
+/* the live match on this shard with a fighter called name (any if len is
+ * 0), or NULL
+ */
+static struct match *find_match(struct client *head, const char *name, int len) {
+    struct client *q;
+    for (q = head; q != NULL; q = q->next) {
+        if (q->in_match == true && q->match != NULL && q->match->if_over == false
+            && (len == 0 || (q->namelen == len && memcmp(q->name, name, len) == 0))) {
+            return q->match;
+        }
+    }
+    return NULL;
+}
+
+/* tell a new spectator who fights and how they stand */
+static int print_spectate(struct client *p) {
+    struct match *m = p->watching;
+    char frame[1 + NAME_SIZE];
+    char *at;
+    int i;
+    
+    if (p->if_binary == true) {
+        for (i = 0; i < 2; i++) {
+            frame[0] = i;
+            memcpy(&frame[1], m->fighters[i]->name, m->fighters[i]->namelen);
+            if (queue_frame(p, BIN_SPECTATE, frame, 1 + m->fighters[i]->namelen) == -1) {
+                return -1;
+            }
+        }
+        return print_score(p);
+    }
+    // both names twice: the line, then the score
+    if ((at = out_begin(p, 4 * MSG_SIZE)) == NULL) {
+        return -1;
+    }
+    at = PUT(at, "You watch ");
+    at = put_name(at, m->fighters[0]);
+    at = PUT(at, " fight ");
+    at = put_name(at, m->fighters[1]);
+    at = PUT(at, ".\n");
+    at = put_score(at, m);
+    out_end(p, at);
+    return 0;
+}
+
+/* show a spectator the hitpoints of both fighters */
+static int print_score(struct client *p) {
+    char *at;
+    if (p->if_binary == true) {
+        char frame[4];
+        score_frame(p->watching, frame);
+        return queue_frame(p, BIN_SEE_STATUS, frame, 4);
+    }
+    if ((at = out_begin(p, 2 * MSG_SIZE)) == NULL) {
+        return -1;
+    }
+    at = put_score(at, p->watching);
+    out_end(p, at);
+    return 0;
+}
+
+/* write both fighters' hitpoints to at; returns the end of what was written */
+static char *put_score(char *at, struct match *m) {
+    int i;
+    for (i = 0; i < 2; i++) {
+        at = put_name(at, m->fighters[i]);
+        at = PUT(at, "'s hitpoints: ");
+        at = put_int(at, m->battle.hitpoints[i]);
+        at = PUT(at, "\n");
+    }
+    return PUT(at, "\n");
+}
+
+/* fill in the 4-byte payload of a BIN_SEE_STATUS frame */
+static void score_frame(struct match *m, char *frame) {
+    frame[0] = m->battle.hitpoints[0];
+    frame[1] = m->battle.powermoves[0];
+    frame[2] = m->battle.hitpoints[1];
+    frame[3] = m->battle.powermoves[1];
+}
+
+/* index of fighter p in its match */
+static int fighter(struct client *p) {
+    return p == p->match->fighters[0] ? 0 : 1;
+}
+
+/* Make room for max bytes at the end of one of m's event buffers (*b) and
+ * return where to write them, or NULL if memory runs out. Events are only
+ * rendered for a match with spectators; see_end() closes the event.
+ */
+static char *see_begin(struct match *m, struct outbuf **b, int max) {
+    if (*b != NULL && (*b)->cap - (*b)->len < max) {
+        fan_out_match(m); // a busy iteration: hand over what we have early
+    }
+    if (*b == NULL && (*b = outbuf_new(OUTBUF_SIZE)) == NULL) {
+        return NULL;
+    }
+    see_push(m);
+    return &(*b)->data[(*b)->len];
+}
+
+/* the event started by see_begin() in b ends at end */
+static void see_end(struct outbuf *b, char *end) {
+    b->len = end - b->data;
+}
+
+/* add a frame to m's events for binary spectators */
+static void see_frame(struct match *m, int type, const char *payload, int len) {
+    char *at = see_begin(m, &m->seen_bin, 2 + len);
+    if (at == NULL) {
+        return;
+    }
+    *at++ = type;
+    *at++ = len;
+    at = put_bytes(at, payload, len);
+    see_end(m->seen_bin, at);
+}
+
+/* show p's move to the spectators of its match. damage 0 means it missed */
+static void see_damage(struct client *p, bool powermove, int damage) {
+    struct match *m = p->match;
+    char frame[3];
+    char *at;
+    
+    if (m->viewers == NULL) {
+        return;
+    }
+    if ((at = see_begin(m, &m->seen, 2 * MSG_SIZE)) != NULL) {
+        at = put_name(at, p);
+        if (damage == 0) {
+            at = PUT(at, " missed!\n");
+        } else {
+            if (powermove) {
+                at = PUT(at, " powermoves ");
+            } else {
+                at = PUT(at, " hits ");
+            }
+            at = put_name(at, p->opponent);
+            at = PUT(at, " for ");
+            at = put_int(at, damage);
+            at = PUT(at, " damage!\n");
+        }
+        see_end(m->seen, at);
+    }
+    frame[0] = fighter(p);
+    frame[1] = powermove ? BIN_DAMAGE_POWERMOVE : 0;
+    frame[2] = damage;
+    see_frame(m, BIN_SEE_DAMAGE, frame, 3);
+}
+
+/* show the spectators of m where the fighters stand after a turn */
+static void see_status(struct match *m) {
+    char frame[4];
+    char *at;
+    
+    if (m->viewers == NULL) {
+        return;
+    }
+    if ((at = see_begin(m, &m->seen, 2 * MSG_SIZE)) != NULL) {
+        at = put_score(at, m);
+        see_end(m->seen, at);
+    }
+    score_frame(m, frame);
+    see_frame(m, BIN_SEE_STATUS, frame, 4);
+}
+
+/* show the spectators of p's match what p said */
+static void see_chat(struct client *p, const char *message, int len) {
+    struct match *m = p->match;
+    char frame[BIN_PAYLOAD_MAX];
+    char *at;
+    
+    if (m->viewers == NULL) {
+        return;
+    }
+    if ((at = see_begin(m, &m->seen, MSG_SIZE + BUF_SIZE)) != NULL) {
+        at = put_name(at, p);
+        at = PUT(at, " says: ");
+        at = put_bytes(at, message, len);
+        at = PUT(at, "\n");
+        see_end(m->seen, at);
+    }
+    if (len > BIN_PAYLOAD_MAX - 1) {
+        len = BIN_PAYLOAD_MAX - 1;
+    }
+    frame[0] = fighter(p);
+    memcpy(&frame[1], message, len);
+    see_frame(m, BIN_SEE_CHAT, frame, 1 + len);
+}
+
+/* show the spectators how the match of winner and loser ended */
+static void see_result(struct client *winner, struct client *loser, bool dropped) {
+    struct match *m = winner->match;
+    char frame[2];
+    char *at;
+    
+    if (m == NULL || m->viewers == NULL) {
+        return;
+    }
+    if ((at = see_begin(m, &m->seen, 2 * MSG_SIZE)) != NULL) {
+        if (dropped) {
+            at = put_name(at, loser);
+            at = PUT(at, " dropped. ");
+            at = put_name(at, winner);
+            at = PUT(at, " wins!\n\n");
+        } else {
+            at = put_name(at, winner);
+            at = PUT(at, " beats ");
+            at = put_name(at, loser);
+            at = PUT(at, "!\n\n");
+        }
+        see_end(m->seen, at);
+    }
+    frame[0] = fighter(winner);
+    frame[1] = dropped;
+    see_frame(m, BIN_SEE_END, frame, 2);
+}
+
+/* add m to the list of matches with events to fan out */
+static void see_push(struct match *m) {
+    if (m->if_seen == true) {
+        return;
+    }
+    m->seen_next = seenhead;
+    seenhead = m;
+    m->if_seen = true;
+}
+
+/* hand the events of every match that had some to its spectators */
+static void fan_out(void) {
+    while (seenhead != NULL) {
+        struct match *m = seenhead;
+        seenhead = m->seen_next;
+        m->if_seen = false;
+        fan_out_match(m);
+    }
+}
+
+/* Queue m's events for each of its spectators: one shared buffer, no
+ * copying. A spectator with SPECTATOR_BACKLOG segments still unsent (or
+ * backlogged, see out_backlogged()) skips them, and gets the score
+ * instead once it has caught up. An ended match
+ * lets its spectators go and is freed.
+ */
+static void fan_out_match(struct match *m) {
+    struct client *v, *next;
+    
+    for (v = m->viewers; v != NULL; v = next) {
+        struct outbuf *b = v->if_binary ? m->seen_bin : m->seen;
+        next = v->view_next;
+        if (m->if_over == false && (v->nsegs >= SPECTATOR_BACKLOG || out_backlogged(v) == true)) {
+            if (b != NULL) {
+                v->if_lagging = true;
+                STAT_ADD(spectator_skips, 1);
+            }
+            continue;
+        }
+        if (m->if_over == false && v->if_lagging == true) {
+            v->if_lagging = false;
+            print_score(v);
+        } else if (b != NULL) {
+            queue_shared(v, b);
+        }
+        if (m->if_over == true) {
+            stop_watching(v);
+            if (v->if_binary == true) {
+                queue_frame(v, BIN_SPECTATE, NULL, 0);
+            }
+        }
+    }
+    if (m->seen != NULL) {
+        outbuf_release(m->seen);
+        m->seen = NULL;
+    }
+    if (m->seen_bin != NULL) {
+        outbuf_release(m->seen_bin);
+        m->seen_bin = NULL;
+    }
+    if (m->if_over == true && m->if_seen == false) {
+        pool_put(&match_pool, m);
+    }
+}
+
+//int handleclient(struct client *p, struct client *top) {
+//    char buf[256];
+//    char outbuf[512];
+//    int len = read(p->fd, buf, sizeof(buf) - 1);
+//    if (len > 0) {
+//        buf[len] = '\0';
+//        printf("Received %d bytes: %s", len, buf);
+//        sprintf(outbuf, "%s says: %s", inet_ntoa(p->ipaddr), buf);
+//        broadcast(top, outbuf, strlen(outbuf));
+//        return 0;
+//    } else if (len == 0) {
+//        // socket is closed
+//        printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
+//        sprintf(outbuf, "Goodbye %s\r\n", inet_ntoa(p->ipaddr));
+//        broadcast(top, outbuf, strlen(outbuf));
+//        return -1;
+//    } else { // shouldn't happen
+//        perror("read");
+//        return -1;
+//    }
+//}
+
+/* bind and listen, abort on error
+ * returns FD of listening socket
+ */
+int bindandlisten(void) {
+    struct sockaddr_in r;
+    int listenfd;
+    
+    // non-blocking, so acceptclient() can drain it until EAGAIN
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int yes = 1;
+    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+    }
+    // every shard binds its own listener to the same port
+    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+    }
+    memset(&r, '\0', sizeof(r));
+    r.sin_family = AF_INET;
+    r.sin_addr.s_addr = INADDR_ANY;
+    r.sin_port = htons(PORT);
+    
+    if (bind(listenfd, (struct sockaddr *)&r, sizeof r)) {
+        perror("bind");
+        exit(1);
+    }
+    
+    if (listen(listenfd, backlog)) {
+        perror("listen");
+        exit(1);
+    }
+    return listenfd;
+}
+
+
+/* Add a new player to the end of the list. Name not added. If there is no
+ * memory for it the list is returned unchanged and fd is not indexed.
+ */
+static struct client *addclient(struct client *top, int fd, struct in_addr addr) {
+    struct client *p = pool_get(&client_pool);
+    if (!p) {
+        perror("malloc");
+        return top;
+    }
+    
+    STAT_ADD(clients, 1);
+    
+    // create a new client
+    p->fd = fd;
+    p->ipaddr = addr;
+    p->next = NULL;
+    p->prev = NULL;
+    p->id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+    p->name = p->short_name;
+    p->name[0] = '\0';
+    p->namelen = 0;
+    p->buf = NULL;
+    p->if_name = false;
+    p->if_active = false;
+    p->in_match = false;
+    p->if_waiting = false;
+    p->if_leaving = false;
+    p->wait_next = NULL;
+    p->wait_prev = NULL;
+    p->rate_next = NULL;
+    p->rate_prev = NULL;
+    p->rating = RATING_START;
+    p->opponent = NULL;
+    p->last_opponent = 0;
+    p->wait_since = 0;
+    p->last_input = wheel_now;
+    timer_init(&p->idle_timer, p, TIMER_IDLE);
+    timer_init(&p->turn_timer, p, TIMER_TURN);
+    timer_init(&p->match_timer, p, TIMER_MATCH);
+    timer_init(&p->throttle_timer, p, TIMER_THROTTLE);
+    rate_fill(p);
+    if (name_ticks > 0) {
+        timer_arm(&p->idle_timer, name_ticks);
+    } else if (idle_ticks > 0) {
+        timer_arm(&p->idle_timer, idle_ticks);
+    }
+    p->match = NULL;
+    p->inhead = 0;
+    p->intail = 0;
+    p->inscan = 0;
+    p->if_discarding = false;
+    p->if_binary = false;
+    p->if_throttled = false;
+    p->outhead = NULL;
+    p->outtail = NULL;
+    p->if_dirty = false;
+    p->if_blocked = false;
+    p->if_receiving = false;
+    p->move_to = NULL;
+    p->watching = NULL;
+    p->view_next = NULL;
+    p->view_prev = NULL;
+    p->nsegs = 0;
+    p->outbytes = 0;
+    p->if_observing = false;
+    p->if_lagging = false;
+    p->dirty_next = NULL;
+    p->dirty_prev = NULL;
+    
+    // ask new player's name
+    QUEUE_LITERAL(p, "What is your name? ");
+
+    // index the new client by its fd
+    setclient(fd, p);
+
+    // add the new client to the end of the list
+    list_append(&top, p);
+    return top;
+}
+
+/* point clients[fd] at p, growing the table if needed */
+static void setclient(int fd, struct client *p) {
+    if (fd >= maxclients) {
+        int newmax = maxclients ? maxclients : 1024;
+        while (newmax <= fd) {
+            newmax *= 2;
+        }
+        struct client **grown = realloc(clients, newmax * sizeof(struct client *));
+        if (!grown) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(&grown[maxclients], 0, (newmax - maxclients) * sizeof(struct client *));
+        clients = grown;
+        maxclients = newmax;
+    }
+    clients[fd] = p;
+}
+
+/* Sets the player's name. If the player hasn't finished inputting
+ * his name, just updates the name buffer
+ */
+int add_name(struct client *head, struct client *p) {
+    char line[NAME_SIZE];
+    int len = next_line(p, line, NAME_SIZE);
+    if (len >= 7 && memcmp(line, "observe", 7) == 0 && (len == 7 || line[7] == ' ')) {
+        // watch without ever entering the arena
+        return lobby_line(head, p, line, len);
+    }
+    if (len >= 0) { // have complete name
+        if (set_name(p, line, len) == -1) {
+            return -1;
+        }
+        return enter_arena(head, p);
+    }
+    return 0;
+}
+
+/* p has a name now: announce it and look for an opponent */
+static int enter_arena(struct client *head, struct client *p) {
+    struct stats_record r;
+    bool known = stats_lookup(p->name, p->namelen, &r);
+    char *at;
+    
+    p->if_name = true;
+    p->rating = known == true ? r.rating : RATING_START;
+    broadcast(head, " enters the arena**\n", BIN_ENTER, p);
+    if (p->if_binary == true) {
+        if (queue_frame(p, BIN_WAITING, NULL, 0) == -1) {
+            return -1;
+        }
+    } else {
+        if ((at = out_begin(p, MSG_SIZE)) == NULL) {
+            return -1;
+        }
+        at = PUT(at, "Welcome, ");
+        at = put_name(at, p);
+        at = PUT(at, "! Awaiting opponent...\n");
+        out_end(p, at);
+        if (known == true && print_record(p, &r) == -1) {
+            return -1;
+        }
+    }
+    return find_opponent(head, p);
+}
+
+/* Handle the next frame from a binary client. Frames that make no sense
+ * in the player's current state are ignored, like stray text input.
+ */
+static int handle_frame(struct client **head, struct client *p) {
+    char payload[BIN_PAYLOAD_MAX];
+    int type, len;
+    
+    if (next_frame(p, &type, payload, &len) == false) {
+        return 0;
+    }
+    if (p->if_name == false && type == BIN_JOIN) {
+        if (len > NAME_SIZE - 1) {
+            len = NAME_SIZE - 1;
+        }
+        if (set_name(p, payload, len) == -1) {
+            return -1;
+        }
+        return enter_arena(*head, p);
+    }
+    else if (p->if_active == true && p->in_match == true) {
+        if (type == BIN_COMMAND && len == 1
+            && (payload[0] == 'a' || (payload[0] == 'p' && p->match->battle.powermoves[fighter(p)] != 0))) {
+            p->command = payload[0];
+            return take_turn(head, p);
+        }
+        if (type == BIN_CHAT) {
+            p->command = 's';
+            return say(p, payload, len);
+        }
+    }
+    else if (p->in_match == false) {
+        if (type == BIN_WATCH && len >= 1) {
+            return spectate(*head, p, payload + 1, len - 1, payload[0] == 1);
+        }
+        if (type == BIN_STOP) {
+            return stop_spectating(*head, p);
+        }
+    }
+    return 0;
+}
+
+/* Take the next complete frame out of a binary client's input. A frame
+ * is at most 2 + BIN_PAYLOAD_MAX bytes, so it always fits in the ring.
+ * return false if no frame is complete yet
+ */
+static bool next_frame(struct client *p, int *type, char *payload, int *len) {
+    unsigned int used = p->intail - p->inhead;
+    int i;
+    
+    if (used < 2) {
+        return false;
+    }
+    *type = (unsigned char)p->buf[p->inhead & (BUF_SIZE - 1)];
+    *len = (unsigned char)p->buf[(p->inhead + 1) & (BUF_SIZE - 1)];
+    if (used < 2 + (unsigned int)*len) {
+        return false;
+    }
+    for (i = 0; i < *len; i++) {
+        payload[i] = p->buf[(p->inhead + 2 + i) & (BUF_SIZE - 1)];
+    }
+    consume_input(p, 2 + *len);
+    return true;
+}
+
+/* queue one binary frame for p. Returns -1 on failure like queue_output */
+static int queue_frame(struct client *p, int type, const void *payload, int len) {
+    char *at;
+    if (len > BIN_PAYLOAD_MAX) {
+        len = BIN_PAYLOAD_MAX;
+    }
+    if ((at = out_begin(p, 2 + len)) == NULL) {
+        return -1;
+    }
+    *at++ = type;
+    *at++ = len;
+    if (len > 0) {
+        at = put_bytes(at, payload, len);
+    }
+    out_end(p, at);
+    return 0;
+}
+
+/* queue a BIN_CHAT_FROM frame; mine is 1 if p said it itself */
+static int queue_chat(struct client *p, int mine, const char *message, int len) {
+    char *at;
+    if (len > BIN_PAYLOAD_MAX - 1) {
+        len = BIN_PAYLOAD_MAX - 1;
+    }
+    if ((at = out_begin(p, 3 + len)) == NULL) {
+        return -1;
+    }
+    *at++ = BIN_CHAT_FROM;
+    *at++ = 1 + len;
+    *at++ = mine;
+    at = put_bytes(at, message, len);
+    out_end(p, at);
+    return 0;
+}
+
+/* Finds a network newline character in the player's input and returns its
+ * offset from inhead, or -1. Bytes already searched are not searched again.
+ */
+int find_network_newline(struct client *p) {
+    unsigned int used = p->intail - p->inhead;
+    while (p->inscan < used) {
+        // search up to the end of the data or of buf, whichever comes first
+        unsigned int at = (p->inhead + p->inscan) & (BUF_SIZE - 1);
+        unsigned int len = BUF_SIZE - at;
+        if (len > used - p->inscan) {
+            len = used - p->inscan;
+        }
+        char *nl = memchr(&p->buf[at], '\n', len);
+        if (nl != NULL) {
+            p->inscan += nl - &p->buf[at];
+            return p->inscan;
+        }
+        p->inscan += len;
+    }
+    return -1;
+}
+
+/* Take the next line of the player's input, without its "\r\n", into line
+ * (cut to size - 1 characters) and return its length. A line that fills the
+ * whole ring is taken as it is and the rest of it is dropped as it arrives.
+ * return -1 if no line is complete yet
+ */
+static int next_line(struct client *p, char *line, int size) {
+    unsigned int used = p->intail - p->inhead;
+    int where = find_network_newline(p);
+    unsigned int len, i;
+    
+    if (where >= 0) {
+        len = where;
+    } else if (used == BUF_SIZE) {
+        len = used;
+        p->if_discarding = true;
+    } else {
+        return -1;
+    }
+    if (len > 0 && p->buf[(p->inhead + len - 1) & (BUF_SIZE - 1)] == '\r') {
+        len--;
+    }
+    for (i = 0; i < len && i < (unsigned int)size - 1; i++) {
+        line[i] = p->buf[(p->inhead + i) & (BUF_SIZE - 1)];
+    }
+    line[i] = '\0';
+    consume_input(p, where >= 0 ? (unsigned int)where + 1 : used);
+    return i;
+}
+
+/* mark the first n bytes of the player's input as handled */
+static void consume_input(struct client *p, unsigned int n) {
+    p->inhead += n;
+    p->inscan = p->inscan > n ? p->inscan - n : 0;
+}
+
+static struct client *removeclient(struct client **top, struct client *p) {
+    struct client *temp = p->opponent;
+    uint64_t now = now_ns();
+    
+    trace_record(TRACE_DROP, now, now, p->id);
+    // remove p from the list, the fd table and the waiting queue
+    list_unlink(top, p);
+    if (p->fd >= 0 && p->fd < maxclients && clients[p->fd] == p) {
+        clients[p->fd] = NULL;
+    }
+    wait_remove(p);
+    stop_watching(p);
+    timer_cancel(&p->idle_timer);
+    timer_cancel(&p->turn_timer);
+    timer_cancel(&p->throttle_timer);
+    
+    // handle p's opponent
+    if (temp != NULL && temp->opponent == p && p->in_match == true) {
+        if (temp->if_binary == true) {
+            char dropped = BIN_END_DROPPED;
+            queue_frame(temp, BIN_END, &dropped, 1);
+        } else {
+            char *at = out_begin(temp, MSG_SIZE);
+            if (at != NULL) {
+                at = PUT(at, "--");
+                at = put_name(at, p);
+                at = PUT(at, " dropped. You win!\n\n");
+                out_end(temp, at);
+            }
+        }
+        see_result(temp, p, true);
+        record_result(temp, p);
+        // update the opponent's status
+        end_of_match(p, temp);
+    }
+    
+    // broadcaset to remaining players that p leaves
+    if (p->if_name == true) {
+        broadcast(*top, " leaves**\n", BIN_LEAVE, p);
+    }
+    
+    // the opponent goes back to the queue if it was still paired with p.
+    // This also covers a match that ended but failed to requeue it.
+    if (temp != NULL && temp->opponent == p) {
+        temp->opponent = NULL; // p's memory is about to be reused
+        if (print_waiting(temp) == -1) {
+            return *top;
+        }
+        find_opponent(*top, temp);
+    }
+    return *top;
+}
+
+/* append p to the end of the list */
+static void list_append(struct client **top, struct client *p) {
+    p->next = NULL;
+    p->prev = tail;
+    if (tail == NULL) {
+        *top = p;
+    } else {
+        tail->next = p;
+    }
+    tail = p;
+}
+
+/* take p out of the list using its prev/next links */
+static void list_unlink(struct client **top, struct client *p) {
+    if (p->prev == NULL) {
+        *top = p->next;
+    } else {
+        p->prev->next = p->next;
+    }
+    if (p->next == NULL) {
+        tail = p->prev;
+    } else {
+        p->next->prev = p->prev;
+    }
+    p->next = NULL;
+    p->prev = NULL;
+}
+
+/* Broadcast "**<source's name><rest>" to every player except for source, on
+ * every shard. The message is rendered once into a shared buffer that all
+ * recipients' queues refer to; binary clients get a frame of the given type
+ * carrying the name instead.
+ */
+static void broadcast(struct client *top, const char *rest, int type, struct client *source) {
+    struct client *p;
+    int i;
+    int restlen = strlen(rest);
+    struct outbuf *b = outbuf_new(2 + source->namelen + restlen);
+    struct outbuf *bin = outbuf_new(2 + source->namelen);
+    char *at;
+    if (b == NULL || bin == NULL) {
+        if (b != NULL) {
+            outbuf_release(b);
+        }
+        if (bin != NULL) {
+            outbuf_release(bin);
+        }
+        return;
+    }
+    at = PUT(b->data, "**");
+    at = put_name(at, source);
+    at = put_bytes(at, rest, restlen);
+    b->len = at - b->data;
+    bin->data[0] = type;
+    bin->data[1] = source->namelen; // names are shorter than BIN_PAYLOAD_MAX
+    at = put_name(&bin->data[2], source);
+    bin->len = at - bin->data;
+    
+    for (p = top; p; p = p->next) {
+        if (p == source) {
+            continue;
+        }
+        if (out_backlogged(p) == true) {
+            STAT_ADD(output_skips, 1);
+        } else {
+            queue_shared(p, p->if_binary ? bin : b);
+        }
+    }
+    // the other shards fan it out to their own players
+    for (i = 0; i < nshards; i++) {
+        if (&shards[i] != self) {
+            atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&bin->refs, 1, memory_order_relaxed);
+            post(&shards[i], MSG_BROADCAST, NULL, b, bin);
+        }
+    }
+    outbuf_release(b); // drop our own references
+    outbuf_release(bin);
+}
+
+/* Append size bytes of s to p's output queue. Nothing is written here; the
+ * queue is sent by flush_dirty() once the current events are handled.
+ * Returns -1 if p is gone or memory runs out.
+ */
+int queue_output(struct client *p, const char *s, int size) {
+    if (p->fd < 0) {
+        return -1;
+    }
+    out_count(p, size);
+    while (size > 0) {
+        struct outseg *seg = p->outtail;
+        // only a private buffer with room left can be appended to
+        if (seg == NULL || atomic_load_explicit(&seg->buf->refs, memory_order_relaxed) != 1
+            || seg->buf->len == seg->buf->cap) {
+            struct outbuf *b = outbuf_new(OUTBUF_SIZE);
+            if (b == NULL) {
+                out_count(p, -size);
+                return -1;
+            }
+            if ((seg = outseg_append(p, b)) == NULL) {
+                outbuf_release(b);
+                out_count(p, -size);
+                return -1;
+            }
+            outbuf_release(b); // the segment holds the only reference now
+        }
+        struct outbuf *b = seg->buf;
+        int n = b->cap - b->len;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(&b->data[b->len], s, n);
+        b->len += n;
+        s += n;
+        size -= n;
+    }
+    dirty_push(p);
+    return 0;
+}
+
+/* Make room for a message of at most max bytes (max <= OUTBUF_SIZE) at the
+ * end of p's queue and return where to write it, or NULL if p is gone or
+ * memory runs out. The message is rendered in place and ended by out_end().
+ */
+static char *out_begin(struct client *p, int max) {
+    struct outseg *seg = p->outtail;
+    if (p->fd < 0) {
+        return NULL;
+    }
+    // only a private buffer with enough room left can be appended to
+    if (seg == NULL || atomic_load_explicit(&seg->buf->refs, memory_order_relaxed) != 1
+        || seg->buf->cap - seg->buf->len < max) {
+        struct outbuf *b = outbuf_new(OUTBUF_SIZE);
+        if (b == NULL) {
+            return NULL;
+        }
+        if ((seg = outseg_append(p, b)) == NULL) {
+            outbuf_release(b);
+            return NULL;
+        }
+        outbuf_release(b); // the segment holds the only reference now
+    }
+    return &seg->buf->data[seg->buf->len];
+}
+
+/* the message started by out_begin() ends at end: queue it */
+static void out_end(struct client *p, char *end) {
+    struct outbuf *b = p->outtail->buf;
+    out_count(p, end - &b->data[b->len]);
+    b->len = end - b->data;
+    dirty_push(p);
+}
+
+/* copy len bytes to at; returns the end of what was written */
+static char *put_bytes(char *at, const char *s, int len) {
+    memcpy(at, s, len);
+    return at + len;
+}
+
+/* write who's name to at; returns the end of what was written */
+static char *put_name(char *at, struct client *who) {
+    return put_bytes(at, who->name, who->namelen);
+}
+
+/* write n in decimal to at; returns the end of what was written */
+static char *put_int(char *at, int n) {
+    char digits[10];
+    unsigned int u = n < 0 ? -(unsigned int)n : (unsigned int)n;
+    int i = 0;
+    if (n < 0) {
+        *at++ = '-';
+    }
+    do {
+        digits[i++] = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    while (i > 0) {
+        *at++ = digits[--i];
+    }
+    return at;
+}
+
+/* write n in decimal to at, for totals too big for put_int(); returns
+ * the end of what was written
+ */
+static char *put_u64(char *at, uint64_t n) {
+    char digits[20];
+    int i = 0;
+    do {
+        digits[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    while (i > 0) {
+        *at++ = digits[--i];
+    }
+    return at;
+}
+
+/* queue a shared buffer for p without copying it. Returns -1 on failure */
+static int queue_shared(struct client *p, struct outbuf *b) {
+    if (p->fd < 0 || outseg_append(p, b) == NULL) {
+        return -1;
+    }
+    out_count(p, b->len);
+    dirty_push(p);
+    return 0;
+}
+
+/* Allocate an empty output buffer holding one reference. Private buffers
+ * (cap == OUTBUF_SIZE) come from the pool; broadcasts are sized exactly.
+ */
+static struct outbuf *outbuf_new(int cap) {
+    struct outbuf *b;
+    if (cap == OUTBUF_SIZE) {
+        b = pool_get(&outbuf_pool);
+    } else {
+        b = malloc(sizeof(struct outbuf) + cap);
+    }
+    if (b == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    atomic_init(&b->refs, 1);
+    b->len = 0;
+    b->cap = cap;
+    return b;
+}
+
+/* drop one reference to b, freeing it with the last one */
+static void outbuf_release(struct outbuf *b) {
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1) {
+        if (b->cap == OUTBUF_SIZE) {
+            pool_put(&outbuf_pool, b);
+        } else {
+            free(b);
+        }
+    }
+}
+
+/* add a segment for b to the end of p's queue, taking a reference to b */
+static struct outseg *outseg_append(struct client *p, struct outbuf *b) {
+    struct outseg *seg = pool_get(&outseg_pool);
+    if (seg == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+    seg->next = NULL;
+    seg->buf = b;
+    seg->start = 0;
+    p->nsegs++;
+    if (p->outtail == NULL) {
+        p->outhead = seg;
+    } else {
+        p->outtail->next = seg;
+    }
+    p->outtail = seg;
+    return seg;
+}
+
+/* Write as much of p's output queue as the socket takes, one writev() per
+ * batch of segments. On io_uring the batch is queued as a send instead.
+ * Returns -1 if the connection is broken.
+ */
+static int flushclient(struct client *p) {
+    struct iovec iov[MAX_IOV];
+    
+    if (ring.fd >= 0) {
+        return uring_send(p);
+    }
+    while (p->outhead != NULL && p->if_blocked == false) {
+        struct outseg *seg;
+        int n = 0;
+        for (seg = p->outhead; seg != NULL && n < MAX_IOV; seg = seg->next) {
+            iov[n].iov_base = &seg->buf->data[seg->start];
+            iov[n].iov_len = seg->buf->len - seg->start;
+            n++;
+        }
+        
+        ssize_t nbytes = writev(p->fd, iov, n);
+        STAT_ADD(write_calls, 1);
+        if (nbytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                uint64_t now = now_ns();
+                trace_record(TRACE_BLOCKED, now, now, p->id);
+                p->if_blocked = true; // wait for EPOLLOUT
+                return 0;
+            }
+            return -1;
+        }
+        STAT_ADD(bytes_written, nbytes);
+        output_sent(p, nbytes);
+    }
+    return 0;
+}
+
+/* the first nbytes of p's queue have been sent: release the segments that
+ * went completely
+ */
+static void output_sent(struct client *p, int nbytes) {
+    out_count(p, -nbytes);
+    while (nbytes > 0) {
+        struct outseg *seg = p->outhead;
+        int left = seg->buf->len - seg->start;
+        if (nbytes < left) {
+            seg->start += nbytes;
+            break;
+        }
+        nbytes -= left;
+        p->outhead = seg->next;
+        if (p->outhead == NULL) {
+            p->outtail = NULL;
+        }
+        p->nsegs--;
+        outbuf_release(seg->buf);
+        pool_put(&outseg_pool, seg);
+    }
+}
+/* flush every client that has queued output, dropping broken connections */
+static void flush_dirty(void) {
+    uint64_t start = now_ns();
+    int flushed = 0;
+    
+    if (output_budget > 0) {
+        output_tight = SUM(stats.output_bytes) > output_budget;
+    }
+    while (dirtyhead != NULL) {
+        struct client *p = dirtyhead;
+        dirty_remove(p);
+        flushed++;
+        if (flushclient(p) == -1) {
+            // may queue output for others, which is flushed too
+            dropclient(p, DROP_WRITE_ERROR);
+        } else if (out_overflowing(p) == true) {
+            dropclient(p, DROP_SLOW); // a fighter forfeits its match
+        }
+    }
+    trace_record(TRACE_FLUSH, start, now_ns(), flushed);
+}
+
+/* add p to the list of clients with output to flush */
+static void dirty_push(struct client *p) {
+    if (p->if_dirty == true) {
+        return;
+    }
+    p->dirty_prev = NULL;
+    p->dirty_next = dirtyhead;
+    if (dirtyhead != NULL) {
+        dirtyhead->dirty_prev = p;
+    }
+    dirtyhead = p;
+    p->if_dirty = true;
+}
+
+/* take p out of the dirty list if it is in it */
+static void dirty_remove(struct client *p) {
+    if (p->if_dirty == false) {
+        return;
+    }
+    if (p->dirty_prev == NULL) {
+        dirtyhead = p->dirty_next;
+    } else {
+        p->dirty_prev->dirty_next = p->dirty_next;
+    }
+    if (p->dirty_next != NULL) {
+        p->dirty_next->dirty_prev = p->dirty_prev;
+    }
+    p->dirty_next = NULL;
+    p->dirty_prev = NULL;
+    p->if_dirty = false;
+}
+
+/* discard whatever output is still queued for p */
+static void free_output(struct client *p) {
+    struct outseg *seg = p->outhead;
+    while (seg != NULL) {
+        struct outseg *next = seg->next;
+        outbuf_release(seg->buf);
+        pool_put(&outseg_pool, seg);
+        seg = next;
+    }
+    p->outhead = NULL;
+    p->outtail = NULL;
+    p->nsegs = 0;
+    out_count(p, -p->outbytes);
+}
+
+/* p's output queue grew by n bytes (shrank, if n is negative) */
+static void out_count(struct client *p, long n) {
+    p->outbytes += n;
+    STAT_ADD(output_bytes, n);
+}
+
+/* True if p should be spared output that can be lost: chat, arena
+ * announcements and the events of a match it watches. That is once its
+ * queue is past a quarter of output_limit, or when output as a whole is
+ * over budget and p's socket isn't taking any more.
+ */
+static bool out_backlogged(struct client *p) {
+    if (output_limit > 0 && p->outbytes > output_limit / 4) {
+        return true;
+    }
+    return output_tight == true && p->if_blocked == true;
+}
+
+/* True if p has so much output unsent that it must go: more than
+ * output_limit, or a quarter of it while output as a whole is over budget.
+ */
+static bool out_overflowing(struct client *p) {
+    if (output_limit == 0) {
+        return false;
+    }
+    return p->outbytes > output_limit || (output_tight == true && p->outbytes > output_limit / 4);
+}
+
+/* Take an object from the pool, carving a new slab when it is empty.
+ * Returns NULL if memory runs out.
+ */
+static void *pool_get(struct pool *pl) {
+    void *obj;
+    if (pl->free == NULL) {
+        size_t size = (pl->size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        char *slab = malloc(size * SLAB_OBJECTS);
+        int i;
+        if (slab == NULL) {
+            return NULL;
+        }
+        for (i = SLAB_OBJECTS - 1; i >= 0; i--) {
+            pool_put(pl, slab + i * size);
+        }
+    }
+    obj = pl->free;
+    pl->free = *(void **)obj;
+    return obj;
+}
+
+/* return an object to the pool */
+static void pool_put(struct pool *pl, void *obj) {
+    *(void **)obj = pl->free;
+    pl->free = obj;
+}
+
+/* monotonic time in nanoseconds */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* count v in the first histogram bucket whose bound it does not exceed */
+static void observe(atomic_ulong *hist, const uint64_t *bounds, int nbounds, uint64_t v) {
+    int i = 0;
+    while (i < nbounds && v > bounds[i]) {
+        i++;
+    }
+    atomic_store_explicit(&hist[i],
+        atomic_load_explicit(&hist[i], memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/* Add a finished match to both players' totals. The damage a fighter took
+ * is what it lost from its starting hitpoints, overkill included.
+ */
+static void record_result(struct client *winner, struct client *loser) {
+    struct match *m = winner->match;
+    int w, winner_taken, loser_taken;
+    
+    if (m == NULL) {
+        return;
+    }
+    w = fighter(winner);
+    winner_taken = m->battle.start_hp[w] - m->battle.hitpoints[w];
+    loser_taken = m->battle.start_hp[1 - w] - m->battle.hitpoints[1 - w];
+    update_ratings(winner, loser);
+    stats_post(winner, true, loser_taken, winner_taken);
+    stats_post(loser, false, winner_taken, loser_taken);
+}
+
+/* Move both players' ratings by the Elo rule: the winner gains
+ * RATING_K times the chance it had of losing, and the loser gives as much.
+ */
+static void update_ratings(struct client *winner, struct client *loser) {
+    int change = (RATING_K * (1000 - expected_score(winner->rating - loser->rating)) + 500) / 1000;
+    winner->rating += change;
+    loser->rating -= change;
+}
+
+/* The chance, in thousandths, that a player rated diff points above its
+ * opponent wins: 1 / (1 + 10^(-diff/400)), read off a table in steps of
+ * 25 points and interpolated in between. Beyond 800 points it stays at 99%.
+ */
+static int expected_score(int diff) {
+    static const short table[] = {
+        500, 536, 571, 606, 640, 673, 703, 733, 760, 785, 808, 830, 849, 867, 882, 896,
+        909, 920, 930, 939, 947, 954, 960, 965, 969, 973, 977, 980, 983, 985, 987, 989, 990
+    };
+    int step, i;
+    
+    if (diff < 0) {
+        return 1000 - expected_score(-diff);
+    }
+    if (diff >= 800) {
+        return table[32];
+    }
+    i = diff / 25;
+    step = diff % 25;
+    return table[i] + ((table[i + 1] - table[i]) * step + 12) / 25;
+}
+
+/* hand one player's result to the writer thread */
+static void stats_post(struct client *p, bool won, int dealt, int taken) {
+    struct stats_update *u = malloc(sizeof(struct stats_update));
+    if (u == NULL) {
+        perror("malloc");
+        return;
+    }
+    u->won = won;
+    u->dealt = dealt;
+    u->taken = taken;
+    u->rating = p->rating;
+    u->namelen = p->namelen;
+    memcpy(u->name, p->name, p->namelen);
+    u->next = atomic_load_explicit(&stats_inbox, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&stats_inbox, &u->next, u,
+                                                  memory_order_release, memory_order_relaxed)) {
+        // u->next now holds the current top; try again
+    }
+}
+
+/* Copy the totals of the player called name out of the index. Returns
+ * false if it has none yet. A slot the writer is changing is read again.
+ */
+static bool stats_lookup(const char *name, int len, struct stats_record *out) {
+    uint64_t hash = stats_hash(name, len);
+    unsigned int i, seq;
+    uint32_t used;
+    uint64_t h;
+    
+    for (i = 0; i < STATS_SLOTS; i++) {
+        struct stats_entry *e = &stats_slots[(hash + i) & (STATS_SLOTS - 1)];
+        do {
+            seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+            used = e->used;
+            h = e->hash;
+            *out = e->rec;
+            atomic_thread_fence(memory_order_acquire);
+        } while ((seq & 1) != 0 || seq != atomic_load_explicit(&e->seq, memory_order_relaxed));
+        if (used == 0) {
+            return false;
+        }
+        if (h == hash && out->namelen == (uint32_t)len && memcmp(out->name, name, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* copy the leaderboard into top; returns the number of players on it */
+static int stats_top(struct leader *top) {
+    unsigned int seq;
+    int n;
+    
+    do {
+        seq = atomic_load_explicit(&leaders.seq, memory_order_acquire);
+        n = leaders.n;
+        memcpy(top, leaders.top, sizeof(leaders.top));
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) != 0 || seq != atomic_load_explicit(&leaders.seq, memory_order_relaxed));
+    return n;
+}
+
+/* show a returning player its record */
+static int print_record(struct client *p, const struct stats_record *r) {
+    char *at;
+    
+    if ((at = out_begin(p, MSG_SIZE)) == NULL) {
+        return -1;
+    }
+    at = PUT(at, "Your record: won ");
+    at = put_u64(at, r->wins);
+    at = PUT(at, ", lost ");
+    at = put_u64(at, r->losses);
+    at = PUT(at, ", dealt ");
+    at = put_u64(at, r->dealt);
+    at = PUT(at, " damage and took ");
+    at = put_u64(at, r->taken);
+    at = PUT(at, ". Rating ");
+    at = put_int(at, r->rating);
+    at = PUT(at, ".\n");
+    out_end(p, at);
+    return 0;
+}
+
+/* show p the leaderboard */
+static int print_top(struct client *p) {
+    struct leader top[TOP_N];
+    int n = stats_top(top);
+    int i;
+    char *at;
+    
+    if (n == 0) {
+        return QUEUE_LITERAL(p, "Nobody has won a match yet.\n");
+    }
+    if ((at = out_begin(p, MSG_SIZE * (n + 1))) == NULL) {
+        return -1;
+    }
+    at = PUT(at, "Top players:\n");
+    for (i = 0; i < n; i++) {
+        at = put_int(at, i + 1);
+        at = PUT(at, ". ");
+        at = put_bytes(at, top[i].name, top[i].namelen);
+        at = PUT(at, ": won ");
+        at = put_u64(at, top[i].wins);
+        at = PUT(at, ", lost ");
+        at = put_u64(at, top[i].losses);
+        at = PUT(at, "\n");
+    }
+    out_end(p, at);
+    return 0;
+}
+
+/* Map the index and bring it up to date with the log; without -S, set up
+ * an empty index in memory. Runs before any other thread starts.
+ */
+static void stats_open(void) {
+    size_t size = STATS_HEADER_SIZE + (size_t)STATS_SLOTS * sizeof(struct stats_entry);
+    struct stats_header hdr;
+    struct stat st;
+    char path[PATH_MAX];
+    void *map;
+    int fd = -1, i;
+    long players = 0;
+    
+    if (stats_path == NULL) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        snprintf(path, sizeof(path), "%s.log", stats_path);
+        if ((stats_log = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1
+            || fstat(stats_log, &st) == -1) {
+            perror(path);
+            exit(1);
+        }
+        snprintf(path, sizeof(path), "%s.idx", stats_path);
+        if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+            perror(path);
+            exit(1);
+        }
+        // an index laid out differently or built from another log starts over
+        if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != STATS_MAGIC
+            || hdr.slots != STATS_SLOTS || hdr.record_size != sizeof(struct stats_record)
+            || hdr.log_ino != (uint64_t)st.st_ino || hdr.applied > (uint64_t)st.st_size
+            || hdr.applied % sizeof(struct stats_record) != 0) {
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.magic = STATS_MAGIC;
+            hdr.slots = STATS_SLOTS;
+            hdr.record_size = sizeof(struct stats_record);
+            hdr.log_ino = st.st_ino;
+            if (ftruncate(fd, 0) == -1 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+                perror(path);
+                exit(1);
+            }
+        }
+        if (ftruncate(fd, size) == -1) {
+            perror(path);
+            exit(1);
+        }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    stats_hdr = map;
+    stats_slots = (struct stats_entry *)((char *)map + STATS_HEADER_SIZE);
+    if ((stats_pending = calloc(STATS_SLOTS, sizeof(int))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    // a slot written out in the middle of an update is mended by the replay
+    for (i = 0; i < STATS_SLOTS; i++) {
+        if (stats_slots[i].used != 0) {
+            atomic_store_explicit(&stats_slots[i].seq, 0, memory_order_relaxed);
+            players++;
+        }
+    }
+    atomic_store(&stats_players, players);
+    if (stats_log != -1) {
+        stats_replay();
+    }
+    for (i = 0; i < STATS_SLOTS; i++) {
+        if (stats_slots[i].used != 0) {
+            leader_update(i);
+        }
+    }
+    leaders_publish();
+    if (stats_log != -1) {
+        stats_checkpoint();
+        printf("stats: %ld players in %s.log\n", atomic_load(&stats_players), stats_path);
+    }
+}
+
+/* apply whatever the log holds beyond what the index already reflects */
+static void stats_replay(void) {
+    struct stats_record chunk[64];
+    uint64_t at = stats_hdr->applied;
+    off_t end;
+    ssize_t got;
+    int i, n;
+    
+    while ((got = pread(stats_log, chunk, sizeof(chunk), at)) > 0) {
+        n = got / sizeof(struct stats_record);
+        for (i = 0; i < n; i++) {
+            struct stats_record *r = &chunk[i];
+            struct stats_entry *e;
+            if (r->namelen >= NAME_SIZE || r->check != record_check(r)) {
+                break;
+            }
+            if ((e = stats_find(r->name, r->namelen, stats_hash(r->name, r->namelen))) != NULL) {
+                stats_apply(e, r);
+            }
+            at += sizeof(struct stats_record);
+        }
+        if (n == 0 || i < n) {
+            break;
+        }
+    }
+    
+    // whatever is left is a write cut short by a crash, unless not even the
+    // first record makes sense: then it is a log of another format, which
+    // must not be cut down to nothing
+    end = lseek(stats_log, 0, SEEK_END);
+    if (at == 0 && end >= (off_t)sizeof(struct stats_record)) {
+        fprintf(stderr, "stats: %s.log is not a log this server can read\n", stats_path);
+        exit(1);
+    }
+    if (end > 0 && (uint64_t)end > at) {
+        fprintf(stderr, "stats: dropping %llu damaged bytes at the end of the log\n",
+                (unsigned long long)(end - at));
+        if (ftruncate(stats_log, at) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
+    }
+    stats_log_size = at;
+}
+
+/* The writer thread. Every STATS_BATCH_MS it takes the results the shards
+ * have posted, appends the players' new totals to the log with one write()
+ * and one fdatasync(), and only then shows them in the index and on the
+ * leaderboard, so the index never gets ahead of the log.
+ */
+static void *run_stats(void *arg) {
+    uint64_t last_checkpoint = now_ns();
+    bool if_changed = false; // true if the index changed since the last checkpoint false otherwise
+    bool if_full = false;    // true if a player was turned away by a full index false otherwise
+    
+    (void)arg;
+    while (1) {
+        struct timespec pause = { 0, STATS_BATCH_MS * 1000000L };
+        struct stats_update *u, *next, *rev = NULL;
+        int n = 0, k;
+        
+        nanosleep(&pause, NULL);
+        u = atomic_exchange_explicit(&stats_inbox, NULL, memory_order_acquire);
+        // the stack is newest first; take the results in the order they came
+        while (u != NULL) {
+            next = u->next;
+            u->next = rev;
+            rev = u;
+            u = next;
+        }
+        for (u = rev; u != NULL; u = next) {
+            struct stats_entry *e = stats_find(u->name, u->namelen, stats_hash(u->name, u->namelen));
+            struct stats_record *r;
+            int slot;
+            
+            next = u->next;
+            if (e == NULL) {
+                if (if_full == false) {
+                    fprintf(stderr, "stats: index full, new players are not recorded\n");
+                    if_full = true;
+                }
+                free(u);
+                continue;
+            }
+            if (n == stats_batch_cap) {
+                int cap = stats_batch_cap == 0 ? 256 : stats_batch_cap * 2;
+                struct stats_record *recs = realloc(stats_batch, cap * sizeof(struct stats_record));
+                int *slots = recs == NULL ? NULL : realloc(stats_batch_slot, cap * sizeof(int));
+                if (recs != NULL) {
+                    stats_batch = recs;
+                }
+                if (slots == NULL) {
+                    perror("malloc");
+                    free(u);
+                    continue;
+                }
+                stats_batch_slot = slots;
+                stats_batch_cap = cap;
+            }
+            
+            // start from the player's totals, or from the ones this batch already has
+            slot = e - stats_slots;
+            r = &stats_batch[n];
+            if (stats_pending[slot] != 0) {
+                *r = stats_batch[stats_pending[slot] - 1];
+            } else if (e->used != 0) {
+                *r = e->rec;
+            } else {
+                memset(r, 0, sizeof(*r));
+                r->namelen = u->namelen;
+                memcpy(r->name, u->name, u->namelen);
+            }
+            if (u->won == true) {
+                r->wins++;
+            } else {
+                r->losses++;
+            }
+            r->dealt += u->dealt;
+            r->taken += u->taken;
+            r->rating = u->rating;
+            r->check = record_check(r);
+            stats_batch_slot[n] = slot;
+            stats_pending[slot] = ++n;
+            free(u);
+        }
+        
+        if (n > 0) {
+            stats_write(stats_batch, n);
+            for (k = 0; k < n; k++) {
+                int slot = stats_batch_slot[k];
+                if (stats_pending[slot] == k + 1) { // the player's latest totals
+                    stats_apply(&stats_slots[slot], &stats_batch[k]);
+                    leader_update(slot);
+                    stats_pending[slot] = 0;
+                }
+            }
+            leaders_publish();
+            if_changed = true;
+        }
+        if (stats_log != -1 && if_changed == true
+            && now_ns() - last_checkpoint >= STATS_CHECKPOINT_SECS * 1000000000ULL) {
+            if (stats_log_size >= STATS_COMPACT_BYTES
+                && stats_log_size / 4 > atomic_load(&stats_players) * sizeof(struct stats_record)) {
+                stats_compact();
+            } else {
+                stats_checkpoint();
+            }
+            last_checkpoint = now_ns();
+            if_changed = false;
+        }
+        
+        // a hot restart takes the store over once everything is written
+        pthread_mutex_lock(&restart_lock);
+        if (stats_holding == 1 && atomic_load(&stats_inbox) == NULL) {
+            if (stats_log != -1) {
+                stats_checkpoint();
+                if_changed = false;
+            }
+            stats_holding = 2;
+            pthread_cond_broadcast(&restart_cond);
+            while (stats_holding == 2) {
+                pthread_cond_wait(&restart_cond, &restart_lock);
+            }
+        }
+        pthread_mutex_unlock(&restart_lock);
+    }
+    return NULL;
+}
+
+/* Append n records to the log and wait until they are on disk. If that
+ * fails the log is cut back to its last whole record; the totals still
+ * reach the index, which the next checkpoint makes durable.
+ */
+static void stats_write(const struct stats_record *recs, int n) {
+    if (stats_log == -1) {
+        return;
+    }
+    if (write_all(stats_log, recs, n * sizeof(struct stats_record)) == false) {
+        perror("stats log");
+        if (ftruncate(stats_log, stats_log_size) == -1) {
+            perror("ftruncate");
+        }
+        return;
+    }
+    stats_log_size += n * sizeof(struct stats_record);
+    atomic_fetch_add(&stats_records, n);
+    if (fdatasync(stats_log) == -1) {
+        perror("fdatasync");
+    }
+    atomic_fetch_add(&stats_syncs, 1);
+}
+
+/* write all len bytes of data to fd; false on error */
+static bool write_all(int fd, const void *data, size_t len) {
+    const char *at = data;
+    while (len > 0) {
+        ssize_t w = write(fd, at, len);
+        if (w == -1 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        at += w;
+        len -= w;
+    }
+    return true;
+}
+
+/* Write the index out and note how much of the log it covers, so the next
+ * start only replays what was logged after this.
+ */
+static void stats_checkpoint(void) {
+    if (msync(stats_slots, (size_t)STATS_SLOTS * sizeof(struct stats_entry), MS_SYNC) == -1) {
+        perror("msync");
+        return;
+    }
+    stats_hdr->applied = stats_log_size;
+    if (msync(stats_hdr, STATS_HEADER_SIZE, MS_SYNC) == -1) {
+        perror("msync");
+    }
+}
+
+/* Rewrite the log with only the current totals of every player, then
+ * checkpoint against it. If we die between the rename() and the
+ * checkpoint, the index names the old log's inode and is rebuilt from the
+ * new log at the next start.
+ */
+static void stats_compact(void) {
+    struct stats_record chunk[64];
+    char path[PATH_MAX], tmp[PATH_MAX], dir[PATH_MAX];
+    struct stat st;
+    uint64_t size = 0;
+    int fd, dirfd, i, n = 0;
+    
+    snprintf(path, sizeof(path), "%s.log", stats_path);
+    snprintf(tmp, sizeof(tmp), "%s.log.new", stats_path);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        perror(tmp);
+        return;
+    }
+    for (i = 0; i <= STATS_SLOTS; i++) {
+        if (n == 64 || (i == STATS_SLOTS && n > 0)) {
+            if (write_all(fd, chunk, n * sizeof(struct stats_record)) == false) {
+                perror(tmp);
+                close(fd);
+                unlink(tmp);
+                return;
+            }
+            size += n * sizeof(struct stats_record);
+            n = 0;
+        }
+        if (i < STATS_SLOTS && stats_slots[i].used != 0) {
+            chunk[n++] = stats_slots[i].rec;
+        }
+    }
+    if (fdatasync(fd) == -1 || fstat(fd, &st) == -1 || rename(tmp, path) == -1) {
+        perror(tmp);
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    // make the rename itself durable
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((dirfd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    printf("stats: compacted %s from %llu to %llu bytes\n", path,
+           (unsigned long long)stats_log_size, (unsigned long long)size);
+    close(stats_log);
+    stats_log = fd;
+    stats_log_size = size;
+    stats_hdr->log_ino = st.st_ino;
+    stats_checkpoint();
+}
+
+/* Find the slot of the player called name, or the free slot it would
+ * take; NULL if the index is full. A free slot that a record in the
+ * current batch is waiting for is already taken.
+ */
+static struct stats_entry *stats_find(const char *name, int len, uint64_t hash) {
+    unsigned int i;
+    
+    for (i = 0; i < STATS_SLOTS; i++) {
+        unsigned int slot = (hash + i) & (STATS_SLOTS - 1);
+        struct stats_entry *e = &stats_slots[slot];
+        const struct stats_record *r = &e->rec;
+        
+        if (e->used == 0) {
+            if (stats_pending[slot] == 0) {
+                return atomic_load(&stats_players) < STATS_SLOTS / 4 * 3 ? e : NULL;
+            }
+            r = &stats_batch[stats_pending[slot] - 1];
+        } else if (e->hash != hash) {
+            continue;
+        }
+        if (r->namelen == (uint32_t)len && memcmp(r->name, name, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* make r the totals in slot e, claiming the slot if it was free */
+static void stats_apply(struct stats_entry *e, const struct stats_record *r) {
+    unsigned int seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    
+    atomic_store_explicit(&e->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if (e->used == 0) {
+        e->used = 1;
+        e->hash = stats_hash(r->name, r->namelen);
+        atomic_fetch_add(&stats_players, 1);
+    }
+    e->rec = *r;
+    atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+}
+
+/* FNV-1a hash of a player's name */
+static uint64_t stats_hash(const char *name, int len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* FNV-1a checksum of everything in a record after the checksum itself */
+static uint32_t record_check(const struct stats_record *r) {
+    const unsigned char *at = (const unsigned char *)r + sizeof(r->check);
+    uint32_t h = 0x811c9dc5;
+    size_t i;
+    for (i = 0; i < sizeof(*r) - sizeof(r->check); i++) {
+        h = (h ^ at[i]) * 0x01000193;
+    }
+    return h;
+}
+
+/* Give slot its place on the writer's leaderboard, if it has earned one.
+ * Wins never go down, so nobody who drops off ever needs to be put back.
+ */
+static void leader_update(int slot) {
+    uint32_t wins = stats_slots[slot].rec.wins;
+    int i = 0;
+    
+    while (i < ntop && top_slots[i] != slot) {
+        i++;
+    }
+    if (i == ntop) {
+        if (wins == 0) {
+            return;
+        }
+        if (ntop < TOP_N) {
+            ntop++;
+        } else if (wins <= stats_slots[top_slots[TOP_N - 1]].rec.wins) {
+            return;
+        }
+        i = ntop - 1; // take the last place, then move up
+    }
+    while (i > 0 && stats_slots[top_slots[i - 1]].rec.wins < wins) {
+        top_slots[i] = top_slots[i - 1];
+        i--;
+    }
+    top_slots[i] = slot;
+}
+
+/* copy the writer's leaderboard to where shards and the admin thread read it */
+static void leaders_publish(void) {
+    unsigned int seq = atomic_load_explicit(&leaders.seq, memory_order_relaxed);
+    int i;
+    
+    atomic_store_explicit(&leaders.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (i = 0; i < ntop; i++) {
+        const struct stats_record *r = &stats_slots[top_slots[i]].rec;
+        leaders.top[i].wins = r->wins;
+        leaders.top[i].losses = r->losses;
+        leaders.top[i].namelen = r->namelen;
+        memcpy(leaders.top[i].name, r->name, r->namelen);
+    }
+    leaders.n = ntop;
+    atomic_store_explicit(&leaders.seq, seq + 2, memory_order_release);
+}
+
+/* Listen on the restart socket (-H) for a new process to hand over to.
+ * Only a process of our own user may take the players over.
+ */
+static void *run_restart(void *arg) {
+    struct sockaddr_un addr;
+    int listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    
+    (void)arg;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, restart_path);
+    unlink(restart_path); // the previous process's, or one left by a crash
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || listen(listenfd, 1) == -1) {
+        perror("restart socket");
+        return NULL;
+    }
+    while (1) {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid()) {
+            hand_over(fd);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Stop every shard and the stats writer, send everything to the new
+ * process on sock and exit once it has it all. If anything goes wrong
+ * on the way, everybody carries on.
+ */
+static void hand_over(int sock) {
+    uint32_t ack = 0;
+    int fds[1], nfds = 0, i;
+    uint64_t start = now_ns();
+    
+    pthread_mutex_lock(&restart_lock);
+    if_frozen = true;
+    pthread_mutex_unlock(&restart_lock);
+    for (i = 0; i < nshards; i++) {
+        post(&shards[i], MSG_FREEZE, NULL, NULL, NULL);
+    }
+    pthread_mutex_lock(&restart_lock);
+    while (nfrozen < nshards) {
+        pthread_cond_wait(&restart_cond, &restart_lock);
+    }
+    // the results of the last matches are all posted now
+    stats_holding = 1;
+    while (stats_holding != 2) {
+        pthread_cond_wait(&restart_cond, &restart_lock);
+    }
+    pthread_mutex_unlock(&restart_lock);
+    
+    if (send_sessions(sock) == true
+        && restart_recv(sock, &ack, sizeof(ack), fds, &nfds) == sizeof(ack) && ack == RESTART_ACK) {
+        printf("handed over to the new process in %.1f ms\n", (now_ns() - start) / 1e6);
+        fflush(stdout);
+        exit(0);
+    }
+    fprintf(stderr, "hot restart failed, carrying on\n");
+    pthread_mutex_lock(&restart_lock);
+    if_frozen = false;
+    stats_holding = 0;
+    pthread_cond_broadcast(&restart_cond);
+    while (nfrozen > 0) {
+        pthread_cond_wait(&restart_cond, &restart_lock);
+    }
+    pthread_mutex_unlock(&restart_lock);
+}
+
+/* Collect every session of the frozen shards, and those still in an inbox
+ * on their way between shards, and send them. Returns false if that fails.
+ */
+static bool send_sessions(int sock) {
+    struct session_ref *refs = NULL;
+    int n = 0, cap = 0, i;
+    bool ok;
+    
+    for (i = 0; i < nshards; i++) {
+        struct client *p = shards[i].frozen;
+        struct shard_msg *m = atomic_load(&shards[i].inbox);
+        while (p != NULL || m != NULL) {
+            struct client *q;
+            if (p != NULL) {
+                q = p;
+                p = p->next;
+            } else {
+                q = m->type == MSG_CLIENT ? m->p : NULL;
+                m = m->next;
+                if (q == NULL) {
+                    continue;
+                }
+            }
+            if (n == cap) {
+                struct session_ref *grown;
+                cap = cap == 0 ? 1024 : cap * 2;
+                if ((grown = realloc(refs, cap * sizeof(struct session_ref))) == NULL) {
+                    free(refs);
+                    return false;
+                }
+                refs = grown;
+            }
+            refs[n].p = q;
+            refs[n++].shard = i;
+        }
+    }
+    // sessions go in address order, so a pointer's position is a bsearch away
+    if (n > 0) {
+        qsort(refs, n, sizeof(struct session_ref), compare_refs);
+    }
+    ok = send_handover(sock, refs, n);
+    free(refs);
+    return ok;
+}
+
+/* Send the listeners, the n sessions in refs with their sockets, their
+ * matches and their unsent output, then RESTART_DONE.
+ */
+static bool send_handover(int sock, struct session_ref *refs, int n) {
+    static char msg[RESTART_MSG_SIZE];
+    struct restart_hello hello;
+    int fds[RESTART_MAX_FDS];
+    int i, j, k;
+    
+    if (nshards + 1 > RESTART_MAX_FDS) {
+        return false;
+    }
+    memset(&hello, 0, sizeof(hello));
+    hello.type = RESTART_HELLO;
+    hello.magic = RESTART_MAGIC;
+    hello.image_size = sizeof(struct session_image);
+    hello.nlisteners = nshards;
+    hello.has_admin = admin_fd != -1;
+    hello.next_id = atomic_load(&next_id);
+    for (i = 0; i < nshards; i++) {
+        fds[i] = shards[i].listenfd;
+    }
+    fds[nshards] = admin_fd;
+    if (restart_send(sock, &hello, sizeof(hello), fds, nshards + hello.has_admin) == false) {
+        return false;
+    }
+    
+    // the sessions, each with its socket
+    for (i = 0; i < n; i += RESTART_BATCH) {
+        struct session_image *img = (struct session_image *)(msg + 2 * sizeof(uint32_t));
+        int count = n - i < RESTART_BATCH ? n - i : RESTART_BATCH;
+        ((uint32_t *)msg)[0] = RESTART_CLIENTS;
+        ((uint32_t *)msg)[1] = count;
+        for (k = 0; k < count; k++) {
+            image_session(&img[k], &refs[i + k], refs, n);
+            fds[k] = refs[i + k].p->fd;
+        }
+        if (restart_send(sock, msg, 2 * sizeof(uint32_t) + count * sizeof(struct session_image),
+                         fds, count) == false) {
+            return false;
+        }
+    }
+    
+    // the matches, each found through the fighter who moves first
+    k = 0;
+    for (i = 0; i <= n; i++) {
+        struct match_image *img = (struct match_image *)(msg + 2 * sizeof(uint32_t));
+        struct match *m = i < n ? refs[i].p->match : NULL;
+        if (k == RESTART_BATCH || (i == n && k > 0)) {
+            ((uint32_t *)msg)[0] = RESTART_MATCHES;
+            ((uint32_t *)msg)[1] = k;
+            if (restart_send(sock, msg, 2 * sizeof(uint32_t) + k * sizeof(struct match_image),
+                             NULL, 0) == false) {
+                return false;
+            }
+            k = 0;
+        }
+        if (m != NULL && m->fighters[0] == refs[i].p) {
+            img[k].fighters[0] = i;
+            img[k].fighters[1] = session_index(refs, n, m->fighters[1]);
+            for (j = 0; j < 2; j++) {
+                img[k].hitpoints[j] = m->battle.hitpoints[j];
+                img[k].powermoves[j] = m->battle.powermoves[j];
+                img[k].start_hp[j] = m->battle.start_hp[j];
+            }
+            img[k].turn = m->battle.turn;
+            img[k].seed = m->seed;
+            memcpy(img[k].rng, m->battle.rng.s, sizeof(img[k].rng));
+            k++;
+        }
+    }
+    
+    // the output the sockets haven't taken yet
+    for (i = 0; i < n; i++) {
+        struct outseg *seg;
+        int len = 2 * sizeof(uint32_t);
+        ((uint32_t *)msg)[0] = RESTART_OUTPUT;
+        ((uint32_t *)msg)[1] = i;
+        for (seg = refs[i].p->outhead; seg != NULL; seg = seg->next) {
+            int start = seg->start;
+            while (start < seg->buf->len) {
+                int chunk = seg->buf->len - start;
+                if (chunk > RESTART_MSG_SIZE - len) {
+                    chunk = RESTART_MSG_SIZE - len;
+                }
+                memcpy(msg + len, &seg->buf->data[start], chunk);
+                len += chunk;
+                start += chunk;
+                if (len == RESTART_MSG_SIZE) {
+                    if (restart_send(sock, msg, len, NULL, 0) == false) {
+                        return false;
+                    }
+                    len = 2 * sizeof(uint32_t);
+                }
+            }
+        }
+        if (len > (int)(2 * sizeof(uint32_t)) && restart_send(sock, msg, len, NULL, 0) == false) {
+            return false;
+        }
+    }
+    
+    ((uint32_t *)msg)[0] = RESTART_DONE;
+    if (restart_send(sock, msg, sizeof(uint32_t), NULL, 0) == false) {
+        return false;
+    }
+    printf("handing over %d players\n", n);
+    return true;
+}
+
+/* describe the session ref points at for the new process */
+static void image_session(struct session_image *img, struct session_ref *ref,
+                          struct session_ref *refs, int n) {
+    struct client *p = ref->p;
+    struct outseg *seg;
+    unsigned int k;
+    
+    memset(img, 0, sizeof(*img));
+    img->id = p->id;
+    img->last_opponent = p->last_opponent;
+    img->wait_since = p->wait_since;
+    img->ipaddr = p->ipaddr.s_addr;
+    img->shard = ref->shard;
+    img->opponent = session_index(refs, n, p->opponent);
+    img->match = p->match == NULL ? -1 : session_index(refs, n, p->match->fighters[0]);
+    img->watching = p->watching == NULL ? -1 : session_index(refs, n, p->watching->fighters[0]);
+    img->rating = p->rating;
+    img->command = p->command;
+    img->namelen = p->namelen;
+    memcpy(img->name, p->name, p->namelen);
+    img->inlen = p->intail - p->inhead;
+    img->inscan = p->inscan;
+    for (k = 0; k < (unsigned int)img->inlen; k++) {
+        img->buf[k] = p->buf[(p->inhead + k) & (BUF_SIZE - 1)];
+    }
+    for (seg = p->outhead; seg != NULL; seg = seg->next) {
+        img->outlen += seg->buf->len - seg->start;
+    }
+    img->if_name = p->if_name;
+    img->in_match = p->in_match;
+    img->if_active = p->if_active;
+    img->if_binary = p->if_binary;
+    img->if_discarding = p->if_discarding;
+    img->if_observing = p->if_observing;
+    img->if_lagging = p->if_lagging;
+}
+
+/* p's position in the handover, -1 if p is NULL or not in it */
+static int session_index(struct session_ref *refs, int n, struct client *p) {
+    struct session_ref key, *at;
+    if (p == NULL || n == 0) {
+        return -1;
+    }
+    key.p = p;
+    at = bsearch(&key, refs, n, sizeof(struct session_ref), compare_refs);
+    return at == NULL ? -1 : at - refs;
+}
+
+/* order sessions by the address of their client, for session_index() */
+static int compare_refs(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)((const struct session_ref *)a)->p;
+    uintptr_t y = (uintptr_t)((const struct session_ref *)b)->p;
+    return x < y ? -1 : x > y;
+}
+
+/* If a server is listening on the restart socket, take its listeners and
+ * players over. Once connected there is no way back: if the handover
+ * breaks off, the old server carries on and this one gives up.
+ */
+static void take_over(void) {
+    static char msg[RESTART_MSG_SIZE];
+    struct sockaddr_un addr;
+    struct restart_hello hello;
+    struct client **restored = NULL;
+    int *target = NULL, *opponent = NULL, *watching = NULL;
+    int fds[RESTART_MAX_FDS];
+    int n = 0, cap = 0, nfds, i, k;
+    uint32_t ack = RESTART_ACK;
+    ssize_t len;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, restart_path);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return; // nobody to take over from
+    }
+    
+    len = restart_recv(sock, &hello, sizeof(hello), fds, &nfds);
+    if (len != sizeof(hello) || hello.type != RESTART_HELLO || hello.magic != RESTART_MAGIC
+        || hello.image_size != sizeof(struct session_image)
+        || nfds != (int)(hello.nlisteners + hello.has_admin)) {
+        fprintf(stderr, "hot restart: the running server is incompatible\n");
+        exit(1);
+    }
+    // a shard more than before gets a listener of its own; one fewer leaves
+    // its listener's backlog behind
+    for (i = 0; i < (int)hello.nlisteners; i++) {
+        if (i < nshards) {
+            shards[i].listenfd = fds[i];
+        } else {
+            close(fds[i]);
+        }
+    }
+    if (hello.has_admin) {
+        admin_fd = fds[hello.nlisteners];
+    }
+    atomic_store(&next_id, hello.next_id);
+    
+    while ((len = restart_recv(sock, msg, sizeof(msg), fds, &nfds)) >= (ssize_t)sizeof(uint32_t)
+           && ((uint32_t *)msg)[0] != RESTART_DONE) {
+        uint32_t type = ((uint32_t *)msg)[0];
+        uint32_t count = len >= (ssize_t)(2 * sizeof(uint32_t)) ? ((uint32_t *)msg)[1] : 0;
+        
+        if (type == RESTART_CLIENTS && nfds == (int)count
+            && len == (ssize_t)(2 * sizeof(uint32_t) + count * sizeof(struct session_image))) {
+            struct session_image *img = (struct session_image *)(msg + 2 * sizeof(uint32_t));
+            if (n + (int)count > cap) {
+                cap = cap == 0 ? 1024 : cap * 2;
+                if (cap < n + (int)count) {
+                    cap = n + count;
+                }
+                if ((restored = realloc(restored, cap * sizeof(struct client *))) == NULL
+                    || (target = realloc(target, cap * sizeof(int))) == NULL
+                    || (opponent = realloc(opponent, cap * sizeof(int))) == NULL
+                    || (watching = realloc(watching, cap * sizeof(int))) == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+            }
+            for (k = 0; k < (int)count; k++, n++) {
+                struct client *p = pool_get(&client_pool);
+                if (p == NULL || img[k].namelen < 0 || img[k].namelen >= NAME_SIZE
+                    || img[k].inlen < 0 || img[k].inlen > BUF_SIZE) {
+                    fprintf(stderr, "hot restart: bad session\n");
+                    exit(1);
+                }
+                memset(p, 0, sizeof(*p));
+                p->fd = fds[k];
+                p->ipaddr.s_addr = img[k].ipaddr;
+                p->id = img[k].id;
+                p->last_opponent = img[k].last_opponent;
+                p->wait_since = img[k].wait_since;
+                p->rating = img[k].rating;
+                p->command = img[k].command;
+                p->name = p->short_name;
+                if (set_name(p, img[k].name, img[k].namelen) == -1) {
+                    exit(1);
+                }
+                if (img[k].inlen > 0) {
+                    if (inbuf_attach(p) == false) {
+                        exit(1);
+                    }
+                    memcpy(p->buf, img[k].buf, img[k].inlen);
+                }
+                p->intail = img[k].inlen;
+                p->inscan = img[k].inscan;
+                p->if_name = img[k].if_name;
+                p->in_match = img[k].in_match;
+                p->if_active = img[k].if_active;
+                p->if_binary = img[k].if_binary;
+                p->if_discarding = img[k].if_discarding;
+                p->if_observing = img[k].if_observing;
+                p->if_lagging = img[k].if_lagging;
+                restored[n] = p;
+                target[n] = img[k].shard % nshards;
+                opponent[n] = img[k].opponent;
+                watching[n] = img[k].watching;
+            }
+        } else if (type == RESTART_MATCHES
+                   && len == (ssize_t)(2 * sizeof(uint32_t) + count * sizeof(struct match_image))) {
+            struct match_image *img = (struct match_image *)(msg + 2 * sizeof(uint32_t));
+            for (k = 0; k < (int)count; k++) {
+                struct match *m = pool_get(&match_pool);
+                if (m == NULL || img[k].fighters[0] < 0 || img[k].fighters[0] >= n
+                    || img[k].fighters[1] < 0 || img[k].fighters[1] >= n) {
+                    fprintf(stderr, "hot restart: bad match\n");
+                    exit(1);
+                }
+                memset(m, 0, sizeof(*m));
+                m->seed = img[k].seed;
+                memcpy(m->battle.rng.s, img[k].rng, sizeof(m->battle.rng.s));
+                for (i = 0; i < 2; i++) {
+                    m->fighters[i] = restored[img[k].fighters[i]];
+                    m->fighters[i]->match = m;
+                    m->battle.hitpoints[i] = img[k].hitpoints[i];
+                    m->battle.powermoves[i] = img[k].powermoves[i];
+                    m->battle.start_hp[i] = img[k].start_hp[i];
+                }
+                m->battle.turn = img[k].turn & 1;
+                m->battle.winner = -1;
+                m->if_seen = false;
+                m->if_over = false;
+            }
+        } else if (type == RESTART_OUTPUT && len > (ssize_t)(2 * sizeof(uint32_t)) && count < (uint32_t)n) {
+            int size = len - 2 * sizeof(uint32_t);
+            struct outbuf *b = outbuf_new(size);
+            if (b == NULL || outseg_append(restored[count], b) == NULL) {
+                exit(1);
+            }
+            memcpy(b->data, msg + 2 * sizeof(uint32_t), size);
+            b->len = size;
+            restored[count]->outbytes += size; // counted by the shard in restoreclient()
+            outbuf_release(b); // the segment holds the only reference now
+        } else {
+            fprintf(stderr, "hot restart: unexpected message\n");
+            exit(1);
+        }
+    }
+    if (len < (ssize_t)sizeof(uint32_t) || restart_send(sock, &ack, sizeof(ack), NULL, 0) == false) {
+        fprintf(stderr, "hot restart: the running server went away\n");
+        exit(1);
+    }
+    close(sock);
+    
+    // pairings and spectators point at sessions now; each goes to its shard
+    for (i = 0; i < n; i++) {
+        struct client *p = restored[i];
+        if (opponent[i] >= 0 && opponent[i] < n) {
+            p->opponent = restored[opponent[i]];
         }
-        
-        // print status on player's side
-        if (print_status(p) == -1 || print_active_player(p) == -1) {
-            return -1;
+        if (watching[i] >= 0 && watching[i] < n) {
+            p->watching = restored[watching[i]]->match;
         }
-        // print status on opponent's side
-        if (print_status(p->opponent) == -1 || print_inactive_player(p->opponent) == -1) {
-            return -2;
+        if (p->in_match == true && (p->match == NULL || p->opponent == NULL)) {
+            p->in_match = false; // half a match can't go on
+            p->match = NULL;
         }
-        
-        p->inbuf = 0;
-        p->command = '\0'; // initialize command for the next action
     }
-
-    return 0;
+    for (i = 0; i < n; i++) {
+        post(&shards[target[i]], MSG_RESTORE, restored[i], NULL, NULL);
+    }
+    printf("took over %d players from the previous server\n", n);
+    free(restored);
+    free(target);
+    free(opponent);
+    free(watching);
 }
 
-/* Find an opponent for p */
-int find_opponent(struct client *head, struct client *p) {
-    struct client *current = head;
+/* carry on with a session the previous process handed over */
+static void restoreclient(struct client *p) {
+    struct match *m = p->watching;
     
-    
-    while (current!= NULL) {
-        fprintf(stderr, "%s is seaching %s\n", p->name, current->name);
-        if (current->if_name == true && current != p && current->in_match == false
-            && current->last_opponent != p) { // restriction for a new oppoent
-            fprintf(stderr, "found %s\n", current->name);
-
-            char outbuf[200];
-            
-            // update status of p
-            p->opponent = current;
-            p->last_opponent = current;
-            p->if_active = true;
-            p->in_match = true;
-            sprintf(outbuf, "You engage %s!\n", current->name);
-            if (write(p->fd, outbuf, strlen(outbuf)) == -1) {
-                return -1;
-            }
-            
-            // update status of opponent
-            current->opponent = p;
-            current->last_opponent = p;
-            current->if_active = false;
-            current->in_match = true;
-            sprintf(outbuf, "You engage %s!\n", p->name);
-            if (write(current->fd, outbuf, strlen(outbuf)) == -1) {
-                return -2;
-            }
-            
-            return start_match(head, p, current);
+    setclient(p->fd, p);
+    list_append(&head, p);
+    STAT_ADD(clients, 1);
+    STAT_ADD(output_bytes, p->outbytes);
+    p->last_input = wheel_now;
+    timer_init(&p->idle_timer, p, TIMER_IDLE);
+    timer_init(&p->turn_timer, p, TIMER_TURN);
+    timer_init(&p->match_timer, p, TIMER_MATCH);
+    timer_init(&p->throttle_timer, p, TIMER_THROTTLE);
+    rate_fill(p); // a new process starts every connection afresh
+    p->if_throttled = false;
+    if (watchclient(p) == false) {
+        dropclient(p, DROP_INTERNAL);
+        return;
+    }
+    if (p->if_name == false && name_ticks > 0) {
+        timer_arm(&p->idle_timer, name_ticks);
+    } else if (idle_ticks > 0) {
+        timer_arm(&p->idle_timer, idle_ticks);
+    }
+    if (p->match != NULL && p->match->fighters[0] == p) {
+        STAT_ADD(matches, 1);
+    }
+    // the turn clock starts afresh
+    if (p->in_match == true && p->if_active == true && turn_ticks > 0) {
+        timer_arm(&p->turn_timer, turn_ticks);
+    }
+    if (m != NULL) {
+        p->view_prev = NULL;
+        p->view_next = m->viewers;
+        if (m->viewers != NULL) {
+            m->viewers->view_prev = p;
         }
-        current = current->next;
+        m->viewers = p;
+        STAT_ADD(spectators, 1);
+    }
+    if (p->outhead != NULL) {
+        dirty_push(p);
+    }
+    if (p->in_match == false) {
+        find_opponent(head, p); // back in the queue, if it has a name
+    }
+    if (p->inhead != p->intail) {
+        process_input(p);
     }
-    return 0;
 }
 
-/* set up a new match */
-int start_match(struct client *head, struct client *player, struct client *opponent) {
-    srand(time(NULL)); // initialize rand
-    
-    // assign hitpoints/powermoves/command
-    player->hitpoints = 20 + rand()%11;
-    player->powermoves = 1 + rand()%3;
-    player->command = '\0';
-    opponent->hitpoints = 20 + rand()%11;
-    opponent->powermoves = 1 + rand()%3;
-    opponent->command = '\0';
+/* Bring this shard to a quiet point for a hot restart and wait there while
+ * the handover runs. On io_uring that means cancelling everything in
+ * flight first; what the cancelled receives still bring in is handled as
+ * usual. If the handover fails, the shard carries on.
+ */
+static void freeze(void) {
+    struct client *p;
     
-    // print on player's side
-    if (print_status(player) == -1 || print_active_player(player) == -1) {
-        return -1;
+    if (ring.fd >= 0) {
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = RING_DATA(RING_ACCEPT, 0);
+        sqe->user_data = RING_DATA(RING_CANCEL, 0);
+        for (p = head; p != NULL; p = p->next) {
+            if (p->if_receiving == true || p->if_blocked == true) {
+                uring_cancel(p);
+            }
+        }
+        while (quiet() == false) {
+            uring_enter(true, -1);
+            uring_reap();
+            while (dirtyhead != NULL || seenhead != NULL || leavehead != NULL) {
+                flush_dirty();
+                fan_out();
+                send_leaving();
+            }
+        }
     }
     
-    // print on opponent's side
-    if (print_status(opponent) == -1 || print_inactive_player(opponent) == -1) {
-        return -2;
+    pthread_mutex_lock(&restart_lock);
+    self->frozen = head;
+    nfrozen++;
+    pthread_cond_broadcast(&restart_cond);
+    while (if_frozen == true) {
+        pthread_cond_wait(&restart_cond, &restart_lock);
     }
-    
-    return 0;
+    nfrozen--;
+    pthread_cond_broadcast(&restart_cond);
+    pthread_mutex_unlock(&restart_lock);
+    freezing = false;
+    thaw();
 }
 
-/* print status on active player's side */
-int print_active_player(struct client *p) {
-    char buf[200];
-    sprintf(buf, "(a)ttack\n");
-    if (write(p->fd, buf, strlen(buf)) == -1) { // (a)
-        return -1;
+/* true if nothing is in flight on the shard's ring */
+static bool quiet(void) {
+    struct client *p;
+    if (accepting == true) {
+        return false;
     }
-    if (p->powermoves != 0) { // option if there is powermove left
-        sprintf(buf, "(p)owermoves\n");
-        if (write(p->fd, buf, strlen(buf)) == -1) { // (p)
-            return -1;
+    for (p = head; p != NULL; p = p->next) {
+        if (p->if_receiving == true || p->if_blocked == true) {
+            return false;
         }
     }
-    sprintf(buf, "(s)peak something\n");
-    if (write(p->fd, buf, strlen(buf)) == -1) { // (s)
-        return -1;
+    return true;
+}
+
+/* the handover fell through: serve everybody again */
+static void thaw(void) {
+    struct client *p;
+    for (p = head; p != NULL; p = p->next) {
+        if (ring.fd >= 0 && p->if_receiving == false && p->if_throttled == false) {
+            uring_recv(p);
+        }
+        if (p->outhead != NULL) {
+            dirty_push(p);
+        }
+    }
+    if (ring.fd >= 0 && accepting == false) {
+        uring_accept();
     }
-    return 0;
 }
 
-/* print status on inactive player's side */
-int print_inactive_player(struct client *p) {
-    char buf[200];
-    sprintf(buf, "Waiting for %s to strike...\n\n", p->opponent->name);
-    if (write(p->fd, buf, strlen(buf)) == -1) {
-        return -1;
+/* send one message on the restart socket, with fds riding along */
+static bool restart_send(int sock, const void *data, size_t len, const int *fds, int nfds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * RESTART_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { (void *)data, len };
+    struct msghdr msg;
+    ssize_t sent;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        struct cmsghdr *cmsg;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
     }
-    return 0;
+    while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+        // try again
+    }
+    return sent == (ssize_t)len;
 }
 
-/* print the status of the match*/
-int print_status(struct client *p) {
-    char buf[200];
-    sprintf(buf, "Your hitpoints: %d\n", p->hitpoints);
-    if (write(p->fd, buf, strlen(buf)) == -1) {
-        return -1;
+/* Receive one message from the restart socket into data, and the fds that
+ * came with it. Returns its length, or -1 on error or if it didn't fit.
+ */
+static ssize_t restart_recv(int sock, void *data, size_t size, int *fds, int *nfds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * RESTART_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { data, size };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t len;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    while ((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+        // try again
     }
-    sprintf(buf, "Your powermoves: %d\n\n", p->powermoves);
-    if (write(p->fd, buf, strlen(buf)) == -1) {
-        return -1;
+    *nfds = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); len >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
     }
-    sprintf(buf, "%s's hitpoints: %d\n\n", p->opponent->name, p->opponent->hitpoints);
-    if (write(p->fd, buf, strlen(buf)) == -1) {
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
         return -1;
     }
-    return 0;
+    return len;
 }
 
-
-//int handleclient(struct client *p, struct client *top) {
-//    char buf[256];
-//    char outbuf[512];
-//    int len = read(p->fd, buf, sizeof(buf) - 1);
-//    if (len > 0) {
-//        buf[len] = '\0';
-//        printf("Received %d bytes: %s", len, buf);
-//        sprintf(outbuf, "%s says: %s", inet_ntoa(p->ipaddr), buf);
-//        broadcast(top, outbuf, strlen(outbuf));
-//        return 0;
-//    } else if (len == 0) {
-//        // socket is closed
-//        printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
-//        sprintf(outbuf, "Goodbye %s\r\n", inet_ntoa(p->ipaddr));
-//        broadcast(top, outbuf, strlen(outbuf));
-//        return -1;
-//    } else { // shouldn't happen
-//        perror("read");
-//        return -1;
-//    }
-//}
-
-/* bind and listen, abort on error
- * returns FD of listening socket
+/* Serve the metrics to anyone who connects to the admin port. Requests are
+ * rare and tiny, so one blocking connection at a time is plenty.
  */
-int bindandlisten(void) {
+static void *run_admin(void *arg) {
+    int port = (int)(long)arg;
     struct sockaddr_in r;
+    socklen_t rlen = sizeof(r);
+    int yes = 1, i;
     int listenfd;
-    
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
-        exit(1);
+
+    // keep the listener a hot restart passed on, if it is still the right port
+    if (admin_fd != -1 && (getsockname(admin_fd, (struct sockaddr *)&r, &rlen) == -1
+                           || ntohs(r.sin_port) != port)) {
+        close(admin_fd);
+        admin_fd = -1;
     }
-    int yes = 1;
-    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
-        perror("setsockopt");
+    if (admin_fd == -1) {
+        if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+            perror("socket");
+            return NULL;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        memset(&r, '\0', sizeof(r));
+        r.sin_family = AF_INET;
+        r.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local only
+        r.sin_port = htons(port);
+        if (bind(listenfd, (struct sockaddr *)&r, sizeof r) || listen(listenfd, 5)) {
+            perror("admin socket");
+            close(listenfd);
+            return NULL;
+        }
+        admin_fd = listenfd;
     }
-    memset(&r, '\0', sizeof(r));
-    r.sin_family = AF_INET;
-    r.sin_addr.s_addr = INADDR_ANY;
-    r.sin_port = htons(PORT);
-    
-    if (bind(listenfd, (struct sockaddr *)&r, sizeof r)) {
-        perror("bind");
-        exit(1);
+    listenfd = admin_fd;
+
+    while (1) {
+        char request[1024];
+        char *text = NULL;
+        size_t len = 0;
+        struct timeval timeout = { 1, 0 };
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        // don't let a silent client hold the admin port
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        int n = read(fd, request, sizeof(request) - 1);
+        request[n > 0 ? n : 0] = '\0';
+
+        FILE *f = open_memstream(&text, &len);
+        if (f == NULL) {
+            close(fd);
+            continue;
+        }
+        if (strncmp(request, "GET /metrics", 12) == 0 || strncmp(request, "GET / ", 6) == 0) {
+            fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+            write_metrics(f);
+        } else if (strncmp(request, "GET /trace", 10) == 0) {
+            fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\n\r\n");
+            write_trace(f);
+        } else if (strncmp(request, "GET /leaderboard", 16) == 0) {
+            struct leader top[TOP_N];
+            int n = stats_top(top);
+            fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+            for (i = 0; i < n; i++) {
+                fprintf(f, "%d %u %u %.*s\n", i + 1, top[i].wins, top[i].losses,
+                        top[i].namelen, top[i].name);
+            }
+        } else {
+            fprintf(f, "HTTP/1.0 404 Not Found\r\n\r\n");
+        }
+        fclose(f);
+
+        char *out = text;
+        while (len > 0) {
+            ssize_t w = write(fd, out, len);
+            if (w <= 0) {
+                break;
+            }
+            out += w;
+            len -= w;
+        }
+        free(text);
+        close(fd);
     }
-    
-    if (listen(listenfd, 5)) {
-        perror("listen");
-        exit(1);
+    return NULL;
+}
+
+/* sum one counter of struct shard over every shard */
+static long long sum_shards(size_t offset) {
+    long long total = 0;
+    int i;
+    for (i = 0; i < nshards; i++) {
+        total += atomic_load_explicit((atomic_long *)((char *)&shards[i] + offset),
+                                      memory_order_relaxed);
     }
-    return listenfd;
+    return total;
 }
 
+/* write every metric in Prometheus text format */
+static void write_metrics(FILE *f) {
+    static const char *reasons[NDROP_REASONS] = {
+        "peer_closed", "read_error", "write_error", "internal", "timeout", "slow_consumer",
+        "flooding"
+    };
+    long long waiting = 0;
+    int i;
 
-/* Add a new player to the end of the list. Name not added */
-static struct client *addclient(struct client *top, int fd, struct in_addr addr) {
-    struct client *p = malloc(sizeof(struct client));
-    if (!p) {
-        perror("malloc");
-        exit(1);
+    for (i = 0; i < nshards; i++) {
+        waiting += atomic_load_explicit(&shards[i].nwaiting, memory_order_relaxed);
     }
-    
-    printf("Adding client %s\n", inet_ntoa(addr));
-    
-    // create a new client
-    p->fd = fd;
-    p->ipaddr = addr;
-    p->next = NULL;
-    p->name = malloc(sizeof(char)*200);
-    p->buf = malloc(sizeof(char)*200); // FREEEEEEEEE
-    p->if_name = false;
-    p->if_active = false;
-    p->in_match = false;
-    p->opponent = NULL;
-    p->last_opponent = NULL;
-    p->inbuf = 0;
-    
-    // ask new player's name
-    write(p->fd, "What is your name? ", sizeof(char)*20);
-
-    // add the new client to the end of the list
-    struct client *current = top;
-    if (current == NULL) {
-        top = p;
+    fprintf(f, "# HELP battle_players_connected Players currently connected.\n"
+               "# TYPE battle_players_connected gauge\n"
+               "battle_players_connected %lld\n", SUM(stats.clients));
+    fprintf(f, "# HELP battle_players_waiting Players waiting for an opponent.\n"
+               "# TYPE battle_players_waiting gauge\n"
+               "battle_players_waiting %lld\n", waiting);
+    fprintf(f, "# HELP battle_matches_active Matches in progress.\n"
+               "# TYPE battle_matches_active gauge\n"
+               "battle_matches_active %lld\n", SUM(stats.matches));
+    fprintf(f, "# HELP battle_spectators Players watching a match.\n"
+               "# TYPE battle_spectators gauge\n"
+               "battle_spectators %lld\n", SUM(stats.spectators));
+    fprintf(f, "# HELP battle_spectator_events_skipped_total Match events slow spectators missed.\n"
+               "# TYPE battle_spectator_events_skipped_total counter\n"
+               "battle_spectator_events_skipped_total %lld\n", SUM(stats.spectator_skips));
+    fprintf(f, "# HELP battle_output_queued_bytes Output queued for players and not yet sent.\n"
+               "# TYPE battle_output_queued_bytes gauge\n"
+               "battle_output_queued_bytes %lld\n", SUM(stats.output_bytes));
+    fprintf(f, "# HELP battle_output_skipped_total Chat lines and announcements a backlogged player missed.\n"
+               "# TYPE battle_output_skipped_total counter\n"
+               "battle_output_skipped_total %lld\n", SUM(stats.output_skips));
+    fprintf(f, "# HELP battle_input_throttled_total Times a player's reads were paused for its rate limits.\n"
+               "# TYPE battle_input_throttled_total counter\n"
+               "battle_input_throttled_total %lld\n", SUM(stats.throttles));
+    fprintf(f, "# HELP battle_stats_players Players with a record in the stats store.\n"
+               "# TYPE battle_stats_players gauge\n"
+               "battle_stats_players %ld\n", atomic_load(&stats_players));
+    fprintf(f, "# HELP battle_stats_records_total Records appended to the stats log.\n"
+               "# TYPE battle_stats_records_total counter\n"
+               "battle_stats_records_total %lu\n", atomic_load(&stats_records));
+    fprintf(f, "# HELP battle_stats_syncs_total fdatasync() calls on the stats log.\n"
+               "# TYPE battle_stats_syncs_total counter\n"
+               "battle_stats_syncs_total %lu\n", atomic_load(&stats_syncs));
+    fprintf(f, "# HELP battle_accepts_total Connections accepted.\n"
+               "# TYPE battle_accepts_total counter\n"
+               "battle_accepts_total %lld\n", SUM(stats.accepts));
+    fprintf(f, "# HELP battle_accepts_shed_total Connections closed on accept because descriptors ran out.\n"
+               "# TYPE battle_accepts_shed_total counter\n"
+               "battle_accepts_shed_total %lld\n", SUM(stats.accepts_shed));
+    fprintf(f, "# HELP battle_turns_total Attacks and powermoves handled.\n"
+               "# TYPE battle_turns_total counter\n"
+               "battle_turns_total %lld\n", SUM(stats.turns));
+    fprintf(f, "# HELP battle_turn_timeouts_total Turns attacked automatically after the turn clock ran out.\n"
+               "# TYPE battle_turn_timeouts_total counter\n"
+               "battle_turn_timeouts_total %lld\n", SUM(stats.turn_timeouts));
+    fprintf(f, "# HELP battle_read_bytes_total Bytes read from players.\n"
+               "# TYPE battle_read_bytes_total counter\n"
+               "battle_read_bytes_total %lld\n", SUM(stats.bytes_read));
+    fprintf(f, "# HELP battle_written_bytes_total Bytes written to players.\n"
+               "# TYPE battle_written_bytes_total counter\n"
+               "battle_written_bytes_total %lld\n", SUM(stats.bytes_written));
+    fprintf(f, "# HELP battle_read_syscalls_total read() calls on player sockets.\n"
+               "# TYPE battle_read_syscalls_total counter\n"
+               "battle_read_syscalls_total %lld\n", SUM(stats.read_calls));
+    fprintf(f, "# HELP battle_write_syscalls_total writev() calls on player sockets.\n"
+               "# TYPE battle_write_syscalls_total counter\n"
+               "battle_write_syscalls_total %lld\n", SUM(stats.write_calls));
+    fprintf(f, "# HELP battle_ring_enters_total io_uring_enter() calls (-u).\n"
+               "# TYPE battle_ring_enters_total counter\n"
+               "battle_ring_enters_total %lld\n", SUM(stats.ring_enters));
+    fprintf(f, "# HELP battle_disconnects_total Connections closed, by reason.\n"
+               "# TYPE battle_disconnects_total counter\n");
+    for (i = 0; i < NDROP_REASONS; i++) {
+        fprintf(f, "battle_disconnects_total{reason=\"%s\"} %lld\n",
+                reasons[i], SUM(stats.disconnects[i]));
     }
-    else {
-        while (current->next != NULL) {
-            current = current->next;
+    write_histogram(f, "battle_matchmaking_wait_seconds",
+                    "Time a player waited for an opponent.",
+                    offsetof(struct shard, stats.wait_hist), offsetof(struct shard, stats.wait_count),
+                    offsetof(struct shard, stats.wait_sum_ns), wait_bounds, NWAIT_BUCKETS);
+    write_histogram(f, "battle_turn_duration_seconds",
+                    "Time spent handling one attack or powermove.",
+                    offsetof(struct shard, stats.turn_hist), offsetof(struct shard, stats.turn_count),
+                    offsetof(struct shard, stats.turn_sum_ns), turn_bounds, NTURN_BUCKETS);
+}
+
+/* write one histogram, merged over every shard. hist, count and sum are
+ * offsets of the histogram's fields in struct shard
+ */
+static void write_histogram(FILE *f, const char *name, const char *help,
+                            size_t hist, size_t count, size_t sum,
+                            const uint64_t *bounds, int nbounds) {
+    long long cumulative = 0;
+    int i;
+
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i <= nbounds; i++) {
+        cumulative += sum_shards(hist + i * sizeof(atomic_ulong));
+        if (i < nbounds) {
+            fprintf(f, "%s_bucket{le=\"%g\"} %lld\n", name, bounds[i] / 1e9, cumulative);
+        } else {
+            fprintf(f, "%s_bucket{le=\"+Inf\"} %lld\n", name, cumulative);
         }
-        current->next = p;
     }
-    return top;
+    fprintf(f, "%s_sum %g\n%s_count %lld\n", name, sum_shards(sum) / 1e9, name, sum_shards(count));
 }
 
-/* Sets the player's name. If the player hasn't finished inputting
- * his name, just updates the name buffer
+/* Record an event in this shard's trace ring: a span from start to end
+ * (both from now_ns()), or an instant if they are equal. Only the shard's
+ * own thread writes its ring, so the slot is filled with plain stores and
+ * published by moving the head on.
  */
-int add_name(struct client *head, struct client *p, int nbytes) {
-    int where; // location of network newline
+static void trace_record(enum trace_kind kind, uint64_t start, uint64_t end, uint64_t arg) {
+    unsigned long n = atomic_load_explicit(&self->trace_head, memory_order_relaxed);
+    struct trace_event *e = &self->trace[n & (TRACE_EVENTS - 1)];
     
-    p->inbuf = p->inbuf + nbytes; // update inbuf
+    e->start = start;
+    e->duration = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+    e->kind = kind;
+    e->arg = arg;
+    atomic_store_explicit(&self->trace_head, n + 1, memory_order_release);
+}
+
+/* Write every shard's trace ring in the Chrome trace event format, which
+ * Perfetto and chrome://tracing open, one track per shard. The shards keep
+ * recording meanwhile: each ring is copied, and the events a shard may have
+ * overwritten while it was being copied are left out.
+ */
+static void write_trace(FILE *f) {
+    static const char *names[NTRACE_KINDS] = {
+        "loop", "input", "turn", "matchmaking", "flush", "drop", "write blocked"
+    };
+    static const char *args[NTRACE_KINDS] = {
+        "ready", "player", "player", "player", "clients", "player", "player"
+    };
+    struct trace_event *copy = malloc(TRACE_EVENTS * sizeof(struct trace_event));
+    int pid = getpid();
+    int i;
     
-    where = find_network_newline(p->buf, p->inbuf);
-    if (where >= 0) { // have complete name
-        p->buf[where] = '\0';
-        strncpy(p->name, p->buf, strlen(p->buf)); // copy the complete name in buf to p.name
-        p->if_name = true;
-        p->inbuf = 0;
+    if (copy == NULL) {
+        fprintf(f, "{\"traceEvents\":[]}\n");
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (i = 0; i < nshards; i++) {
+        unsigned long end = atomic_load_explicit(&shards[i].trace_head, memory_order_acquire);
+        unsigned long n = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+        unsigned long now;
         
-        char outbuf[200];
-        sprintf(outbuf, "**%s enters the arena**\n", p->name);
-        broadcast(head, outbuf, strlen(outbuf), p);
-        sprintf(outbuf, "Welcome, %s! Awaiting opponent...\n", p->name);
-        write(p->fd, outbuf, strlen(outbuf));
-        if (write(p->fd, outbuf, strlen(outbuf) == -1)) {
-            return -1;
+        memcpy(copy, shards[i].trace, TRACE_EVENTS * sizeof(struct trace_event));
+        atomic_thread_fence(memory_order_acquire);
+        now = atomic_load_explicit(&shards[i].trace_head, memory_order_relaxed);
+        if (now >= TRACE_EVENTS && n < now - TRACE_EVENTS + 1) { // reused during the copy
+            n = now - TRACE_EVENTS + 1;
+        }
+        
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"shard %d\"}}", i > 0 ? ",\n" : "", pid, i, i);
+        for (; n < end; n++) {
+            const struct trace_event *e = &copy[n & (TRACE_EVENTS - 1)];
+            if (e->kind >= NTRACE_KINDS) {
+                continue;
+            }
+            if (e->kind >= TRACE_DROP) {
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\"", names[e->kind]);
+            } else {
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"dur\":%.3f",
+                        names[e->kind], e->duration / 1e3);
+            }
+            // timestamps are in microseconds
+            fprintf(f, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"%s\":%llu}}",
+                    pid, i, e->start / 1e3, args[e->kind], (unsigned long long)e->arg);
         }
-        return find_opponent(head, p);
     }
-    return 0;
+    fprintf(f, "\n]}\n");
+    free(copy);
 }
 
-/* helper function for add_name. Finds a network newline character*/
-int find_network_newline(char *buf, int inbuf) {
-    int i = 0;
-    while (i <= inbuf) {
-        if (buf[i] == '\n') {
-            return i;
+/* Wait for SIGUSR1, which main() blocked in every thread, and dump the
+ * flight recorder to a new file in the working directory each time.
+ */
+static void *run_trace(void *arg) {
+    sigset_t usr1;
+    int sig;
+    int dumps = 0;
+    
+    (void)arg;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    while (1) {
+        if (sigwait(&usr1, &sig) != 0) {
+            continue;
         }
-        i++;
+        char path[64];
+        snprintf(path, sizeof(path), "trace.%d.%d.json", (int)getpid(), dumps++);
+        FILE *f = fopen(path, "w");
+        if (f == NULL) {
+            perror(path);
+            continue;
+        }
+        write_trace(f);
+        if (fclose(f) != 0) {
+            perror(path);
+            continue;
+        }
+        printf("Trace written to %s\n", path);
+        fflush(stdout);
     }
-    return -1;
+    return NULL;
 }
 
-static struct client *removeclient(struct client **top, struct client *p) {
-    char outbuf[200];
-    
-    if(p->opponent != NULL){
-        // handle p's opponent
-        if (p->in_match == true) {
-            sprintf(outbuf, "--%s dropped. You win!\n\n", p->name);
-            write(p->opponent->fd, outbuf, strlen(outbuf));
-            // update the opponent's status
-            p->opponent->in_match = false;
-            *top = move_to_end(top, p->opponent);
-        }
-        // broadcaset to remaining players that p leaves
-        if (p->if_name == true) {
-            sprintf(outbuf, "**%s leaves**\n", p->name);
-            broadcast(*top, outbuf, strlen(outbuf), p);
+/* set up a timer that is not armed */
+static void timer_init(struct timer *t, struct client *owner, enum timer_kind kind) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->owner = owner;
+    t->kind = kind;
+}
+
+/* (re)arm t to fire ticks from now */
+static void timer_arm(struct timer *t, uint64_t ticks) {
+    timer_cancel(t);
+    t->expires = wheel_now + (ticks > 0 ? ticks : 1);
+    timer_insert(t);
+    ntimers++;
+}
+
+/* disarm t if it is armed */
+static void timer_cancel(struct timer *t) {
+    if (t->pprev == NULL) {
+        return;
+    }
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+    ntimers--;
+}
+
+/* Put t in the slot for its expiry, on the lowest level where it is less
+ * than a lap ahead of where that level stands. Counting in slots of each
+ * level, not in ticks, keeps t out of the slot a level is on: above level
+ * 0 that one has already been cascaded.
+ */
+static void timer_insert(struct timer *t) {
+    uint64_t expires = t->expires > wheel_now ? t->expires : wheel_now;
+    int level = 0, shift = 0;
+    
+    while (level < WHEEL_LEVELS - 1 && (expires >> shift) - (wheel_now >> shift) >= WHEEL_SLOTS) {
+        level++;
+        shift += WHEEL_BITS;
+    }
+    if ((expires >> shift) - (wheel_now >> shift) >= WHEEL_SLOTS) { // beyond the wheel: fire early
+        t->expires = wheel_now + ((uint64_t)(WHEEL_SLOTS - 1) << shift);
+    }
+    struct timer **slot = &wheel[level][(t->expires >> shift) & (WHEEL_SLOTS - 1)];
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+/* Advance the wheel to the current tick, firing every timer that is due.
+ * Timers may be armed or cancelled by the ones that fire.
+ */
+static void run_timers(void) {
+    uint64_t now = now_ns() / TICK_NS;
+    
+    while (wheel_now < now) {
+        if (ntimers == 0) { // nothing to step through
+            wheel_now = now;
+            break;
         }
-        
-        sprintf(outbuf, "Awaiting next opponent...\n");
-        if (write(p->opponent->fd, outbuf, strlen(outbuf)) == -1) {
-            //return -1;
-            return *top;
+        wheel_now++;
+        int slot = wheel_now & (WHEEL_SLOTS - 1);
+        // at the start of each lap, bring the next slot of the level above down
+        if (slot == 0) {
+            int slot1 = (wheel_now >> WHEEL_BITS) & (WHEEL_SLOTS - 1);
+            if (slot1 == 0) {
+                cascade(2, (wheel_now >> (2 * WHEEL_BITS)) & (WHEEL_SLOTS - 1));
+            }
+            cascade(1, slot1);
         }
         
-        struct client *temp = p->opponent;
-        temp->in_match = false;
-        
-        // move the opponent to the end of the list.
-        move_to_end(top, temp);
-        
-        
-        
-        find_opponent(*top, temp);
-        // remove p from the list
-        struct client *current = *top;
-        if (*top == p) {
-            *top = p->next;
-            return *top;
-        }
-        while (current->next != p) {
-            current = current->next;
-
+        // detach the due list so timers can be cancelled while it runs
+        struct timer *due = wheel[0][slot];
+        wheel[0][slot] = NULL;
+        if (due != NULL) {
+            due->pprev = &due;
         }
-        current->next = p->next;
-        //fprintf(stderr, "REMOVE FTN\n");
-        current = *top;
-        while (current->next != NULL) {
-            current = current->next;
-            fprintf(stderr, "linkedlist: %s\n", current->name);
+        while (due != NULL) {
+            struct timer *t = due;
+            timer_cancel(t);
+            timer_expired(t);
         }
-        
+    }
+}
 
-        return *top;
+/* re-file every timer of one slot of a higher level into the levels below */
+static void cascade(int level, int slot) {
+    struct timer *t = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    while (t != NULL) {
+        struct timer *next = t->next;
+        timer_insert(t);
+        t = next;
     }
-else{
-    // broadcaset to remaining players that p leaves
-    if (p->if_name == true) {
-        sprintf(outbuf, "**%s leaves**\n", p->name);
-        broadcast(*top, outbuf, strlen(outbuf), p);
+}
+
+/* milliseconds until the next tick, or -1 (forever) if no timer is armed */
+static int next_timeout(void) {
+    uint64_t now, next;
+    if (ntimers == 0) {
+        return -1;
     }
-    
-    // remove p from the list
-    struct client *current = *top;
-    if (*top == p) {
-        *top = p->next;
-        return *top;
+    now = now_ns();
+    next = (wheel_now + 1) * TICK_NS;
+    return next > now ? (int)((next - now + 999999) / 1000000) : 0;
+}
+
+/* a timer went off */
+static void timer_expired(struct timer *t) {
+    if (t->kind == TIMER_IDLE) {
+        idle_expired(t->owner);
+    } else if (t->kind == TIMER_TURN) {
+        turn_expired(t->owner);
+    } else if (t->kind == TIMER_MATCH) {
+        match_expired(t->owner);
+    } else {
+        throttle_expired(t->owner);
+    }
+}
+
+/* Name deadline or idle check. The idle deadline is not moved on every
+ * read; instead it is checked here against last_input and pushed back.
+ */
+static void idle_expired(struct client *p) {
+    if (p->if_name == false && p->watching == NULL && name_ticks > 0) {
+        dropclient(p, DROP_TIMEOUT);
+        return;
     }
-    while (current->next != p) {
-        current = current->next;
+    if (idle_ticks == 0) {
+        return;
     }
-    current->next = p->next;
-    
-        return *top;
+    if (p->watching != NULL) { // a spectator has no reason to talk
+        p->last_input = wheel_now;
+    }
+    if (wheel_now - p->last_input >= idle_ticks) {
+        dropclient(p, DROP_TIMEOUT);
+        return;
+    }
+    timer_arm(&p->idle_timer, p->last_input + idle_ticks - wheel_now);
 }
+
+/* p's turn clock ran out: attack on p's behalf */
+static void turn_expired(struct client *p) {
+    int result;
+    if (p->in_match == false || p->if_active == false) {
+        return;
+    }
+    STAT_ADD(turn_timeouts, 1);
+    if (p->if_binary == false && QUEUE_LITERAL(p, "\nToo slow! You attack automatically.\n") == -1) {
+        dropclient(p, DROP_INTERNAL);
+        return;
+    }
+    p->command = 'a'; // this also ends a half-typed speak
+    result = take_turn(&head, p);
+    if (result == -1) {
+        dropclient(p, DROP_INTERNAL);
+    } else if (result == -2 && p->opponent != NULL) {
+        dropclient(p->opponent, DROP_INTERNAL);
+    }
 }
 
-/* move the client to the end of the list */
-struct client *move_to_end(struct client **head, struct client *p) {
-    struct client *current = *head;
-    
-    // when p is already at the end of the list
-    if (p->next == NULL) {
-        return *head;
+/* p has waited another second and its rating window is wider, or a match
+ * could not be set up for it a second ago: look again
+ */
+static void match_expired(struct client *p) {
+    struct client *opponent;
+    int result;
+    if (p->if_waiting == false) {
+        return;
     }
-    
-    // remove p from the list
-    if (*head == p) {
-        *head = (*head)->next;
+    if (rating_mode == false) {
+        wait_remove(p);
+        result = find_opponent(head, p);
+        opponent = p->opponent;
+    } else if ((opponent = nearest_opponent(p)) == NULL) {
+        timer_arm(&p->match_timer, TICKS_PER_SEC);
+        return;
     } else {
-        while (current->next != p) {
-            current = current->next;
-        }
-        current->next = p->next;
+        wait_remove(p);
+        result = engage(head, p, opponent);
     }
-    
-    // place p to the end of the list
-    current = *head;
-    while (current->next != NULL) {
-        current = current->next;
+    if (result == -1) {
+        dropclient(p, DROP_INTERNAL);
+    } else if (result == -2) {
+        dropclient(opponent, DROP_INTERNAL);
     }
-    p->next = NULL;
-    current->next = p;
-    
-    return *head;
 }
 
-/* broadcast to every player except for source */
-static void broadcast(struct client *top, char *s, int size, struct client *source) {
-    struct client *p;
-    for (p = top; p; p = p->next) {
-        if (p != source) {
-            write(p->fd, s, size);
-        }
+/* p's reads were paused: carry on reading once its debt is paid off */
+static void throttle_expired(struct client *p) {
+    rate_refill(p);
+    if (rate_exceeded(p) == true) {
+        timer_arm(&p->throttle_timer, rate_wait(p));
+        return;
     }
-    /* should probably check write() return value and perhaps remove client */
+    p->if_throttled = false;
+    p->throttled_until = wheel_now;
+    watch_input(p, true);
 }